@@ -100,6 +100,27 @@ CV_IMPL IplImage* cvRetrieveFrameP( CvCapture* capture, int idx, RetrieveProps &
     return capture ? capture->retrieveFrame(idx, props) : 0;
 }
 
+CV_IMPL bool cvRetrieveFramesP( CvCapture* capture, int idx, RetrieveProps *props, cv::Mat *images, int count)
+{
+    return capture ? capture->retrieveFrames(idx, props, images, count) : false;
+}
+
+CV_IMPL bool cvGetFrameInfoP( CvCapture* capture, FrameInfo &info )
+{
+    return capture ? capture->getFrameInfo(info) : false;
+}
+
+CV_IMPL bool cvStartRecordingP( CvCapture* capture, const char* filename, unsigned capacity )
+{
+    return capture ? capture->startRecording(filename, capacity) : false;
+}
+
+CV_IMPL void cvStopRecordingP( CvCapture* capture )
+{
+    if( capture )
+        capture->stopRecording();
+}
+
 CV_IMPL double cvGetCaptureProperty( CvCapture* capture, int id )
 {
     return capture ? capture->getProperty(id) : 0;
@@ -413,6 +434,9 @@ CV_IMPL CvCapture * cvCreateFileCapture (const char * filename)
         result = cvCreateFileCapture_OpenNI (filename);
 #endif
 
+    if (! result)
+        result = cvCreateFileCapture_Raw (filename);
+
     if (! result)
         result = cvCreateFileCapture_Images (filename);
 
@@ -558,12 +582,8 @@ bool VideoCapture_mod::grab()
     return cvGrabFrame(cap) != 0;
 }
 
-bool VideoCapture_mod::retrieve(OutputArray image, int channel)
+static bool icvCopyRetrieved(IplImage* _img, OutputArray image)
 {
-    if (!icap.empty())
-        return icap->retrieveFrame(channel, image);
-
-    IplImage* _img = cvRetrieveFrameP(cap, channel, retrieveProps);
     if( !_img )
     {
         image.release();
@@ -579,6 +599,36 @@ bool VideoCapture_mod::retrieve(OutputArray image, int channel)
     return true;
 }
 
+bool VideoCapture_mod::retrieve(OutputArray image, int channel)
+{
+    if (!icap.empty())
+        return icap->retrieveFrame(channel, image);
+
+    // convert straight into the caller's matrix if the backend supports it
+    if (image.isMat() && cvRetrieveFramesP(cap, channel, &retrieveProps, &image.getMatRef(), 1))
+        return true;
+    return icvCopyRetrieved(cvRetrieveFrameP(cap, channel, retrieveProps), image);
+}
+
+bool VideoCapture_mod::retrieve(std::vector<RetrieveProps> &props, std::vector<Mat> &images)
+{
+    images.resize(props.size());
+    bool result = true;
+    if (!icap.empty())
+    {
+        for (size_t i = 0; i < props.size(); i++)
+            result = icap->retrieveFrame(0, images[i]) && result;
+        return result;
+    }
+
+    int count = (int)props.size();
+    if (count > 0 && cvRetrieveFramesP(cap, 0, &props[0], &images[0], count))
+        return true;
+    for (int i = 0; i < count; i++)
+        result = icvCopyRetrieved(cvRetrieveFrameP(cap, 0, props[i]), images[i]) && result;
+    return result;
+}
+
 bool VideoCapture_mod::read(OutputArray image)
 {
     if(grab())
@@ -602,6 +652,20 @@ VideoCapture_mod& VideoCapture_mod::operator >> (UMat& image)
 
 bool VideoCapture_mod::set(int propId, double value)
 {
+    // the conversion workers are shared by all the captures
+    if (propId == CAP_PROP_MOD_CONVERT_THREADS || propId == CAP_PROP_MOD_CONVERT_MIN_PIXELS)
+    {
+        int threads, minPixels;
+        retrieve_get_parallel(threads, minPixels);
+        if (propId == CAP_PROP_MOD_CONVERT_THREADS)
+            threads = cvRound(value);
+        else
+            minPixels = cvRound(value);
+        if (threads < 1 || threads > MAX_CONVERT_THREADS || minPixels < 0)
+            return false;
+        retrieve_set_parallel(threads, minPixels);
+        return true;
+    }
     if (!icap.empty())
         return icap->setProperty(propId, value);
     return cvSetCaptureProperty(cap, propId, value) != 0;
@@ -609,15 +673,44 @@ bool VideoCapture_mod::set(int propId, double value)
 
 double VideoCapture_mod::get(int propId)
 {
+    if (propId == CAP_PROP_MOD_CONVERT_THREADS || propId == CAP_PROP_MOD_CONVERT_MIN_PIXELS)
+    {
+        int threads, minPixels;
+        retrieve_get_parallel(threads, minPixels);
+        return propId == CAP_PROP_MOD_CONVERT_THREADS ? threads : minPixels;
+    }
     if (!icap.empty())
         return icap->getProperty(propId);
     return cvGetCaptureProperty(cap, propId);
 }
 
+bool VideoCapture_mod::getFrameInfo(FrameInfo &info)
+{
+    if (!icap.empty())
+        return false;
+    return cvGetFrameInfoP(cap, info);
+}
+
+bool VideoCapture_mod::startRecording(const String& filename, int capacity)
+{
+    if (!icap.empty() || capacity < 1)
+        return false;
+    return cvStartRecordingP(cap, filename.c_str(), capacity);
+}
+
+void VideoCapture_mod::stopRecording()
+{
+    if (icap.empty())
+        cvStopRecordingP(cap);
+}
+
 void VideoCapture_mod::set(RetrieveProps &props) {
     retrieveProps.sampling = props.sampling;
+    retrieveProps.scale = props.scale;
     retrieveProps.region = props.region;
     retrieveProps.colorspace = props.colorspace;
+    retrieveProps.orientation = props.orientation;
+    retrieveProps.remap = props.remap;
 };
 
 
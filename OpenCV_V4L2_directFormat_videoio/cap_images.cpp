@@ -51,6 +51,16 @@
 
 #include "precomp.hpp"
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <condition_variable>
+#include <vector>
+#include <exception>
 
 #include"still_config.h"
 
@@ -77,6 +87,10 @@ public:
         currentframe = firstframe = 0;
         length = 0;
         frame = 0;
+        window = 0;
+        nextDecode = 0;
+        inFlight = 0;
+        stopping = false;
     }
 
     virtual ~CvCapture_Images()
@@ -89,20 +103,49 @@ public:
     virtual double getProperty(int);
     virtual bool setProperty(int, double);
     virtual bool grabFrame();
-    virtual IplImage* retrieveFrame(int);
+    virtual IplImage* retrieveFrame(int, RetrieveProps &props);
 
 protected:
+    // one frame of the read-ahead window, frame n lives in slots[n % window]
+    struct PrefetchSlot
+    {
+        enum { EMPTY, DECODING, READY, FAILED } state;
+        unsigned number;
+        std::vector<uchar> encoded;  // file contents, reused
+        cv::Mat image;               // decoded frame, reused if the size matches
+    };
+
+    bool startPrefetch(unsigned _window);
+    void stopPrefetch();
+    void restartPrefetch(unsigned position);
+    void decodeLoop();
+    bool grabPrefetched();
+
     char*  filename; // actually a printf-pattern
     unsigned currentframe;
     unsigned firstframe; // number of first frame
     unsigned length; // length of sequence
 
     IplImage* frame;
+
+    unsigned window;                // frames decoded ahead, 0 for synchronous loading
+    std::vector<PrefetchSlot> slots;
+    std::vector<std::thread> workers;
+    std::mutex mutex;               // guards the slot states and the counters below
+    std::condition_variable decoded;
+    std::condition_variable released;
+    unsigned nextDecode;            // next frame to hand to a worker
+    unsigned inFlight;              // frames being decoded right now
+    bool stopping;
+    cv::Mat current;                // the grabbed prefetched frame
+    IplImage currentHeader;
 };
 
 
 void CvCapture_Images::close()
 {
+    stopPrefetch();
+    current.release();
     if( filename )
     {
         free(filename);
@@ -116,6 +159,9 @@ void CvCapture_Images::close()
 
 bool CvCapture_Images::grabFrame()
 {
+    if( window )
+        return grabPrefetched();
+
     char str[_MAX_PATH];
     sprintf(str, filename, firstframe + currentframe);
 
@@ -127,11 +173,139 @@ bool CvCapture_Images::grabFrame()
     return frame != 0;
 }
 
-IplImage* CvCapture_Images::retrieveFrame(int)
+IplImage* CvCapture_Images::retrieveFrame(int, RetrieveProps &)
 {
+    if( window )
+        return current.empty() ? 0 : &currentHeader;
     return frame;
 }
 
+bool CvCapture_Images::startPrefetch(unsigned _window)
+{
+    stopPrefetch();
+    if( _window == 0 || !filename )
+        return _window == 0;
+
+    window = _window;
+    slots = std::vector<PrefetchSlot>(window);
+    for( unsigned i = 0; i < window; i++ )
+    {
+        slots[i].state = PrefetchSlot::EMPTY;
+        slots[i].number = UINT_MAX;
+    }
+    nextDecode = currentframe;
+    stopping = false;
+    // decoding is CPU bound, more threads than cores would only add switching
+    unsigned threads = std::max(1u, std::min(window, std::thread::hardware_concurrency()));
+    for( unsigned i = 0; i < threads; i++ )
+        workers.push_back(std::thread(&CvCapture_Images::decodeLoop, this));
+    return true;
+}
+
+void CvCapture_Images::stopPrefetch()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    released.notify_all();
+    for( size_t i = 0; i < workers.size(); i++ )
+        workers[i].join();
+    workers.clear();
+    slots.clear();
+    window = 0;
+}
+
+// Discards the window for a seek, the workers go on from position.
+void CvCapture_Images::restartPrefetch(unsigned position)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    decoded.wait(lock, [this]{ return inFlight == 0; });
+    for( unsigned i = 0; i < window; i++ )
+        slots[i].state = PrefetchSlot::EMPTY;
+    currentframe = position;
+    nextDecode = position;
+    lock.unlock();
+    released.notify_all();
+}
+
+void CvCapture_Images::decodeLoop()
+{
+    char str[_MAX_PATH];
+    std::unique_lock<std::mutex> lock(mutex);
+    for(;;)
+    {
+        // a slot is free again only when grab has taken the frame window places before
+        released.wait(lock, [this]{ return stopping ||
+            (nextDecode < length && nextDecode < currentframe + window); });
+        if( stopping )
+            break;
+
+        unsigned number = nextDecode++;
+        PrefetchSlot &slot = slots[number % window];
+        slot.state = PrefetchSlot::DECODING;
+        slot.number = number;
+        inFlight++;
+        lock.unlock();
+
+        bool ok = false;
+        sprintf(str, filename, firstframe + number);
+        FILE *f = fopen(str, "rb");
+        if( f )
+        {
+            // ftell gives -1 on error
+            long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+            // the buffer allocation and the decoder may throw, failing only this frame
+            try
+            {
+                if( size > 0 && fseek(f, 0, SEEK_SET) == 0 )
+                {
+                    slot.encoded.resize(size);
+                    ok = fread(&slot.encoded[0], 1, size, f) == (size_t)size;
+                }
+                if( ok )
+                {
+                    cv::imdecode(slot.encoded, cv::IMREAD_ANYDEPTH | cv::IMREAD_ANYCOLOR, &slot.image);
+                    ok = !slot.image.empty();
+                }
+            }
+            catch( const std::exception& )
+            {
+                ok = false;
+            }
+            fclose(f);
+        }
+
+        lock.lock();
+        slot.state = ok ? PrefetchSlot::READY : PrefetchSlot::FAILED;
+        inFlight--;
+        decoded.notify_all();
+    }
+}
+
+bool CvCapture_Images::grabPrefetched()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if( currentframe >= length )
+        return false;
+
+    PrefetchSlot &slot = slots[currentframe % window];
+    decoded.wait(lock, [&]{ return slot.number == currentframe &&
+        (slot.state == PrefetchSlot::READY || slot.state == PrefetchSlot::FAILED); });
+    if( slot.state == PrefetchSlot::FAILED )
+        return false;
+
+    // the previous frame goes back to the slot to be decoded into
+    std::swap(current, slot.image);
+    slot.state = PrefetchSlot::EMPTY;
+    currentframe++;
+    lock.unlock();
+    released.notify_all();
+
+    currentHeader = current;
+    return true;
+}
+
 double CvCapture_Images::getProperty(int id)
 {
     switch(id)
@@ -144,12 +318,14 @@ double CvCapture_Images::getProperty(int id)
     case CV_CAP_PROP_POS_AVI_RATIO:
         return (double)currentframe / (double)(length - 1);
     case CV_CAP_PROP_FRAME_WIDTH:
-        return frame ? frame->width : 0;
+        return window ? current.cols : frame ? frame->width : 0;
     case CV_CAP_PROP_FRAME_HEIGHT:
-        return frame ? frame->height : 0;
+        return window ? current.rows : frame ? frame->height : 0;
     case CV_CAP_PROP_FPS:
         CV_WARN("collections of images don't have framerates\n");
         return 1;
+    case CAP_PROP_MOD_PREFETCH:
+        return window;
     case CV_CAP_PROP_FOURCC:
         CV_WARN("collections of images don't have 4-character codes\n");
         return 0;
@@ -171,7 +347,10 @@ bool CvCapture_Images::setProperty(int id, double value)
             CV_WARN("seeking beyond end of sequence - clamping\n");
             value = length - 1;
         }
-        currentframe = cvRound(value);
+        if( window )
+            restartPrefetch(cvRound(value));
+        else
+            currentframe = cvRound(value);
         return true;
     case CV_CAP_PROP_POS_AVI_RATIO:
         if(value > 1) {
@@ -181,8 +360,15 @@ bool CvCapture_Images::setProperty(int id, double value)
             CV_WARN("seeking to negative positions does not work - clamping\n");
             value = 0;
         }
-        currentframe = cvRound((length - 1) * value);
+        if( window )
+            restartPrefetch(cvRound((length - 1) * value));
+        else
+            currentframe = cvRound((length - 1) * value);
         return true;
+    case CAP_PROP_MOD_PREFETCH:
+        if( value < 0 )
+            return false;
+        return startPrefetch(cvRound(value));
     }
     CV_WARN("unknown/unhandled property\n");
     return false;
@@ -299,6 +485,410 @@ CvCapture* cvCreateFileCapture_Images(const char * filename)
     return 0;
 }
 
+//
+//
+// raw YUYV recording replay
+//
+//
+class CvCapture_Raw : public CvCapture
+{
+public:
+    CvCapture_Raw()
+    {
+        fd = -1;
+        data = 0;
+        dataLength = 0;
+        header = 0;
+        index = 0;
+        count = first = position = 0;
+        grabbed = -1;
+        paced = 1;
+        paceBaseUs = 0;
+    }
+
+    virtual ~CvCapture_Raw()
+    {
+        close();
+    }
+
+    virtual bool open(const char* _filename);
+    virtual void close();
+    virtual double getProperty(int);
+    virtual bool setProperty(int, double);
+    virtual bool grabFrame();
+    virtual IplImage* retrieveFrame(int, RetrieveProps &props);
+    virtual bool retrieveFrames(int, RetrieveProps *props, cv::Mat *images, int count);
+    virtual bool getFrameInfo(FrameInfo &info);
+
+protected:
+    int fd;
+    unsigned char* data;          // the whole file mapped
+    size_t dataLength;
+    const RawFileHeader* header;
+    const RawFrameEntry* index;
+    unsigned long count;          // frames available
+    unsigned long first;          // slot of the oldest frame
+    unsigned long position;       // number of the next frame to grab
+    long grabbed;                 // slot of the grabbed frame, -1 if none
+    int paced;                    // nonzero to replay at the recorded pace
+    int64 paceBaseUs;             // timestamp of the frame replay started with, 0 to restart
+    std::chrono::steady_clock::time_point paceStart;
+
+    cv::Mat converted;            // frame for the IplImage interface
+    IplImage frame;
+};
+
+
+void CvCapture_Raw::close()
+{
+    if( data )
+    {
+        munmap(data, dataLength);
+        data = 0;
+    }
+    if( fd != -1 )
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    header = 0;
+    index = 0;
+    count = first = position = 0;
+    grabbed = -1;
+    converted.release();
+}
+
+bool CvCapture_Raw::open(const char * _filename)
+{
+    close();
+
+    fd = ::open(_filename, O_RDONLY);
+    if( fd == -1 )
+        return false;
+
+    struct stat s;
+    if( fstat(fd, &s) || (uint64_t)s.st_size < sizeof(RawFileHeader) || (uint64_t)s.st_size > RAW_MAX_MAPPING )
+    {
+        close();
+        return false;
+    }
+    dataLength = s.st_size;
+    data = (unsigned char*)mmap(NULL, dataLength, PROT_READ, MAP_SHARED, fd, 0);
+    if( data == MAP_FAILED )
+    {
+        data = 0;
+        close();
+        return false;
+    }
+
+    header = (const RawFileHeader*)data;
+    if( memcmp(header->magic, RAW_FILE_MAGIC, sizeof(header->magic)) ||
+        header->pixelFormat != RAW_PIXEL_FORMAT_YUYV ||
+        header->width == 0 || header->height == 0 || header->capacity == 0 ||
+        header->frameSize != (uint64_t)header->width * header->height * 2 ||
+        header->dataOffset < sizeof(RawFileHeader) + (uint64_t)header->capacity * sizeof(RawFrameEntry) ||
+        header->dataOffset + (uint64_t)header->capacity * header->frameSize > dataLength )
+    {
+        close();
+        return false;
+    }
+    index = (const RawFrameEntry*)(data + sizeof(RawFileHeader));
+
+    // a wrapped recording starts with the slot to be overwritten next
+    count = header->frameCount < header->capacity ? header->frameCount : header->capacity;
+    first = header->frameCount > header->capacity ? header->frameCount % header->capacity : 0;
+    if( count == 0 )
+    {
+        close();
+        return false;
+    }
+    madvise(data + header->dataOffset, (size_t)header->capacity * header->frameSize, MADV_SEQUENTIAL);
+    return true;
+}
+
+bool CvCapture_Raw::grabFrame()
+{
+    if( !data || position >= count )
+        return false;
+
+    grabbed = (first + position) % header->capacity;
+    position++;
+
+    int64 timestampUs = index[grabbed].timestampUs;
+    if( paced && timestampUs != 0 )
+    {
+        if( paceBaseUs == 0 || timestampUs < paceBaseUs )
+        {
+            paceBaseUs = timestampUs;
+            paceStart = std::chrono::steady_clock::now();
+        }
+        else
+            std::this_thread::sleep_until(paceStart + std::chrono::microseconds(timestampUs - paceBaseUs));
+    }
+    return true;
+}
+
+bool CvCapture_Raw::retrieveFrames(int, RetrieveProps *props, cv::Mat *images, int _count)
+{
+    if( grabbed < 0 || _count > MAX_RETRIEVE_TARGETS )
+        return false;
+
+    RetrieveTarget targets[MAX_RETRIEVE_TARGETS];
+    for( int i = 0; i < _count; i++ )
+    {
+        if( !retrieve_resolve_target(header->width, header->height, props[i], targets[i]) )
+        {
+            CV_WARN("invalid scale or region in retrieval properties\n");
+            return false;
+        }
+        images[i].create(targets[i].rows, targets[i].cols, CV_8UC(targets[i].channels));
+        if( !images[i].isContinuous() )
+            return false;
+        targets[i].dst = images[i].data;
+    }
+    RetrieveSource src = { RL_YUYV, (int)header->width, (int)header->height,
+                           data + header->dataOffset + (size_t)grabbed * header->frameSize };
+    frame_to_targets(src, targets, _count);
+    return true;
+}
+
+IplImage* CvCapture_Raw::retrieveFrame(int, RetrieveProps &props)
+{
+    if( !retrieveFrames(0, &props, &converted, 1) )
+        return 0;
+    cvInitImageHeader( &frame, cvSize(converted.cols, converted.rows), IPL_DEPTH_8U, converted.channels(), IPL_ORIGIN_TL, 1 );
+    frame.imageData = (char *)converted.data;
+    return &frame;
+}
+
+bool CvCapture_Raw::getFrameInfo(FrameInfo &info)
+{
+    if( grabbed < 0 )
+        return false;
+    info.timestampUs = index[grabbed].timestampUs;
+    info.sequence = index[grabbed].sequence;
+    info.dropped = index[grabbed].dropped;
+    return true;
+}
+
+double CvCapture_Raw::getProperty(int id)
+{
+    if( !data )
+        return 0;
+    switch(id)
+    {
+    case CV_CAP_PROP_POS_MSEC:
+        return grabbed < 0 ? 0 : (index[grabbed].timestampUs - index[first].timestampUs) / 1000.0;
+    case CV_CAP_PROP_POS_FRAMES:
+        return position;
+    case CV_CAP_PROP_FRAME_COUNT:
+        return count;
+    case CV_CAP_PROP_FRAME_WIDTH:
+        return header->width;
+    case CV_CAP_PROP_FRAME_HEIGHT:
+        return header->height;
+    case CV_CAP_PROP_FPS:
+    {
+        int64 span = index[(first + count - 1) % header->capacity].timestampUs - index[first].timestampUs;
+        return span > 0 ? (count - 1) * 1000000.0 / span : 0;
+    }
+    case CV_CAP_PROP_FOURCC:
+        return header->pixelFormat;
+    case CAP_PROP_MOD_SEQUENCE:
+        return grabbed < 0 ? 0 : index[grabbed].sequence;
+    case CAP_PROP_MOD_DROPPED:
+        return grabbed < 0 ? 0 : index[grabbed].dropped;
+    case CAP_PROP_MOD_REPLAY_PACED:
+        return paced;
+    }
+    return 0;
+}
+
+bool CvCapture_Raw::setProperty(int id, double value)
+{
+    switch(id)
+    {
+    case CV_CAP_PROP_POS_FRAMES:
+        if(value < 0) {
+            CV_WARN("seeking to negative positions does not work - clamping\n");
+            value = 0;
+        }
+        if(value >= count) {
+            CV_WARN("seeking beyond end of sequence - clamping\n");
+            value = count - 1;
+        }
+        position = cvRound(value);
+        paceBaseUs = 0;
+        return true;
+    case CAP_PROP_MOD_REPLAY_PACED:
+        paced = value != 0.0;
+        paceBaseUs = 0;
+        return true;
+    }
+    return false;
+}
+
+
+CvCapture* cvCreateFileCapture_Raw(const char * filename)
+{
+    CvCapture_Raw* capture = new CvCapture_Raw;
+
+    if( capture->open(filename) )
+        return capture;
+
+    delete capture;
+    return 0;
+}
+
+
+CvRawRecorder::CvRawRecorder()
+{
+    fd = -1;
+    data = 0;
+    dataLength = 0;
+    header = 0;
+    index = 0;
+    pending = 0;
+    stopping = false;
+}
+
+bool CvRawRecorder::open(const char* filename, unsigned width, unsigned height, unsigned capacity)
+{
+    close();
+    if( width == 0 || height == 0 || capacity == 0 )
+        return false;
+
+    // computed in 64 bits, size_t would wrap on 32-bit systems
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t frameSize = (uint64_t)width * height * 2;
+    uint64_t dataOffset = (sizeof(RawFileHeader) + (uint64_t)capacity * sizeof(RawFrameEntry) + page - 1) / page * page;
+    uint64_t length = dataOffset + capacity * frameSize;
+    if( length > RAW_MAX_MAPPING || length > SIZE_MAX )
+    {
+        CV_WARN("the recording would be too big to map, lower its capacity\n");
+        return false;
+    }
+    dataLength = length;
+
+    fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( fd == -1 )
+        return false;
+    // allocate the blocks now, so appending never waits for the filesystem to find space
+    if( posix_fallocate(fd, 0, dataLength) )
+    {
+        CV_WARN("could not preallocate the recording\n");
+        close();
+        return false;
+    }
+    data = (unsigned char*)mmap(NULL, dataLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if( data == MAP_FAILED )
+    {
+        data = 0;
+        close();
+        return false;
+    }
+    madvise(data + dataOffset, (size_t)(capacity * frameSize), MADV_SEQUENTIAL);
+
+    header = (RawFileHeader*)data;
+    index = (RawFrameEntry*)(data + sizeof(RawFileHeader));
+    memcpy(header->magic, RAW_FILE_MAGIC, sizeof(header->magic));
+    header->width = width;
+    header->height = height;
+    header->frameSize = frameSize;
+    header->capacity = capacity;
+    header->pixelFormat = RAW_PIXEL_FORMAT_YUYV;
+    header->reserved = 0;
+    header->frameCount = 0;
+    header->dataOffset = dataOffset;
+    writer = std::thread(&CvRawRecorder::writeLoop, this);
+    return true;
+}
+
+void CvRawRecorder::close()
+{
+    if( writer.joinable() )
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        posted.notify_one();
+        writer.join();
+        stopping = false;
+    }
+    if( data )
+    {
+        munmap(data, dataLength);
+        data = 0;
+    }
+    if( fd != -1 )
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    header = 0;
+    index = 0;
+}
+
+bool CvRawRecorder::post(const void* frame, const RawFrameEntry &entry, bool copy)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if( !data || pending )
+        return false;
+
+    if( copy )
+    {
+        copied.resize(header->frameSize);
+        memcpy(&copied[0], frame, header->frameSize);
+        frame = &copied[0];
+    }
+    pending = frame;
+    pendingEntry = entry;
+    posted.notify_one();
+    return true;
+}
+
+bool CvRawRecorder::busy()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return pending != 0;
+}
+
+void CvRawRecorder::flush()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    written.wait(guard, [this] { return pending == 0; });
+}
+
+void CvRawRecorder::append(const void* frame, const RawFrameEntry &entry)
+{
+    uint64_t slot = header->frameCount % header->capacity;
+    memcpy(data + header->dataOffset + slot * header->frameSize, frame, header->frameSize);
+    index[slot] = entry;
+    // counted only when complete, so a reader never sees a half written frame as the newest
+    header->frameCount++;
+}
+
+void CvRawRecorder::writeLoop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for(;;)
+    {
+        // a frame posted before close is still written
+        posted.wait(guard, [this] { return pending != 0 || stopping; });
+        if( !pending )
+            return;
+        const void* frame = pending;
+        RawFrameEntry entry = pendingEntry;
+        guard.unlock();
+        // may block on writeback, only this thread waits then
+        append(frame, entry);
+        guard.lock();
+        pending = 0;
+        written.notify_all();
+    }
+}
+
 //
 //
 // image sequence writer
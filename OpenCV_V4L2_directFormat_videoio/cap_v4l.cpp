@@ -229,6 +229,7 @@ make & enjoy!
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <mutex>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 
@@ -242,6 +243,11 @@ make & enjoy!
 #define HAVE_CAMV4L2
 #endif
 
+#ifdef HAVE_JPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
 #include"still_config.h"
 
 #if USE_NVWA == 1
@@ -274,9 +280,11 @@ struct buffer
 {
   void *  start;
   size_t  length;
+  /* number of leases held on this dequeued buffer, 0 if it is in the queue:
+     one by the last grab, one by the recorder while it writes the frame */
+  int     leases;
 };
 
-static unsigned int n_buffers = 0;
 
 /* Additional V4L2 pixelformats support for Sonix SN9C10x base webcams */
 #ifndef V4L2_PIX_FMT_SBGGR8
@@ -290,6 +298,10 @@ static unsigned int n_buffers = 0;
 #define V4L2_PIX_FMT_SGBRG v4l2_fourcc('G','B','R','G') /* bayer GBRG   GBGB.. RGRG.. */
 #endif
 
+#ifndef V4L2_PIX_FMT_NV12
+#define V4L2_PIX_FMT_NV12 v4l2_fourcc('N','V','1','2') /* 12  Y/CbCr 4:2:0 */
+#endif
+
 #endif  /* HAVE_CAMV4L2 */
 
 enum PALETTE_TYPE {
@@ -302,12 +314,19 @@ enum PALETTE_TYPE {
   PALETTE_SN9C10X,
   PALETTE_MJPEG,
   PALETTE_SGBRG,
-  PALETTE_RGB24
+  PALETTE_RGB24,
+  PALETTE_GREY,
+  PALETTE_NV12,
+  PALETTE_YUV420
 };
 
 typedef struct CvCaptureCAM_V4L
 {
     int deviceHandle;
+    /* nonzero if the device is driven through V4L2, zero for V4L */
+    int v4l2Support;
+    /* the size set by the first of the width and height properties, 0 if none */
+    int pendingWidth, pendingHeight;
     int bufferIndex;
     int FirstCapture;
 #ifdef HAVE_CAMV4L
@@ -319,6 +338,7 @@ typedef struct CvCaptureCAM_V4L
 #endif /* HAVE_CAMV4L */
     char *memoryMap;
     IplImage frame;
+    size_t frameCapacity;
 
 #ifdef HAVE_CAMV4L2
    enum PALETTE_TYPE palette;
@@ -336,6 +356,31 @@ typedef struct CvCaptureCAM_V4L
 
    struct timeval timestamp;
 
+   /* nonzero if grabbed frames are leased direct from the mmap buffers */
+   int leasing;
+   /* index of the buffer leased by the last grab, -1 if none */
+   int leasedIndex;
+   /* nonzero if grab keeps only the newest of the ready buffers */
+   int drainQueue;
+
+   /* sequence number of the last frame, valid if sequenceValid is nonzero */
+   unsigned int sequence;
+   int sequenceValid;
+   /* frames missing from the sequence since streaming began */
+   unsigned long dropped;
+   /* nonzero if the driver stamps frames with CLOCK_MONOTONIC */
+   int monotonic;
+
+   /* receives the raw grabbed frames if not NULL */
+   CvRawRecorder *recorder;
+   /* index of the buffer leased to the recorder, -1 if none */
+   int recordedIndex;
+   /* frames not recorded as the recorder was still writing the previous one */
+   unsigned long recordSkipped;
+
+   /* bit set of the RetrColorspace values mostly retrieved, the palette is chosen for these */
+   int profile;
+
    /* V4L2 control variables */
    int v4l2_brightness, v4l2_brightness_min, v4l2_brightness_max;
    int v4l2_contrast, v4l2_contrast_min, v4l2_contrast_max;
@@ -351,7 +396,6 @@ CvCaptureCAM_V4L;
 
 #ifdef HAVE_CAMV4L2
 
-int V4L2_SUPPORT = 0;
 
 #endif /* HAVE_CAMV4L2 */
 
@@ -367,17 +411,15 @@ static int icvSetVideoSize( CvCaptureCAM_V4L* capture, int w, int h);
 
 /***********************   Implementations  ***************************************/
 
-static int numCameras = 0;
-static int indexList = 0;
-
-/* Simple test program: Find number of Video Sources available.
+/* Simple test program: Find the Video Sources available.
    Start from 0 and go to MAX_CAMERAS while checking for the device with that name.
-   If it fails on the first attempt of /dev/video0, then check if /dev/video is valid.
-   Returns the global numCameras with the correct value (we hope) */
+   Returns a bit set of the device numbers found. The devices are scanned on
+   each call, so no state is shared between captures. */
 
-static void icvInitCapture_V4L() {
+static int icvInitCapture_V4L() {
    int deviceHandle;
    int CameraNumber;
+   int indexList = 0;
    char deviceName[MAX_DEVICE_DRIVER_NAME];
 
    CameraNumber = 0;
@@ -390,7 +432,6 @@ static void icvInitCapture_V4L() {
          /* This device does indeed exist - add it to the total so far */
     // add indexList
     indexList|=(1 << CameraNumber);
-        numCameras++;
     }
     if (deviceHandle != -1)
       close(deviceHandle);
@@ -398,6 +439,7 @@ static void icvInitCapture_V4L() {
       CameraNumber++;
    } /* End while */
 
+   return indexList;
 }; /* End icvInitCapture_V4L */
 
 #ifdef HAVE_CAMV4L
@@ -423,21 +465,65 @@ try_palette(int fd,
 
 #ifdef HAVE_CAMV4L2
 
-static int try_palette_v4l2(CvCaptureCAM_V4L* capture, unsigned long colorspace)
+/* True if the rows and planes of the negotiated format follow each other
+   without padding, as the conversions assume. Compressed formats have no
+   rows, and a missing bytesperline or sizeimage is taken as packed. */
+static bool v4l2_format_packed(const struct v4l2_format &form)
+{
+  unsigned width = form.fmt.pix.width;
+  unsigned height = form.fmt.pix.height;
+  unsigned line, size;
+  switch (form.fmt.pix.pixelformat) {
+  case V4L2_PIX_FMT_GREY:
+  case V4L2_PIX_FMT_SBGGR8:
+  case V4L2_PIX_FMT_SGBRG:
+    line = width;
+    size = width * height;
+    break;
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_YVU420:
+    line = width;
+    size = width * height + (width >> 1) * (height >> 1) * 2;
+    break;
+  case V4L2_PIX_FMT_YUV411P:
+    line = width;
+    size = width * height + (width >> 2) * height * 2;
+    break;
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY:
+    line = width * 2;
+    size = line * height;
+    break;
+  case V4L2_PIX_FMT_BGR24:
+  case V4L2_PIX_FMT_RGB24:
+    line = width * 3;
+    size = line * height;
+    break;
+  default:
+    return true;
+  }
+  return (form.fmt.pix.bytesperline == 0 || form.fmt.pix.bytesperline == line) &&
+         (form.fmt.pix.sizeimage == 0 || form.fmt.pix.sizeimage >= size);
+}
+
+/* Sets the format, failing if the device changes the pixel format or pads
+   its rows. */
+static int try_palette_v4l2(CvCaptureCAM_V4L* capture, unsigned long colorspace, unsigned width, unsigned height)
 {
   CLEAR (capture->form);
 
   capture->form.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   capture->form.fmt.pix.pixelformat = colorspace;
   capture->form.fmt.pix.field       = V4L2_FIELD_ANY;
-  capture->form.fmt.pix.width = DEFAULT_V4L_WIDTH;
-  capture->form.fmt.pix.height = DEFAULT_V4L_HEIGHT;
+  capture->form.fmt.pix.width = width;
+  capture->form.fmt.pix.height = height;
 
   if (-1 == ioctl (capture->deviceHandle, VIDIOC_S_FMT, &capture->form))
       return -1;
 
 
-  if (colorspace != capture->form.fmt.pix.pixelformat)
+  if (colorspace != capture->form.fmt.pix.pixelformat || !v4l2_format_packed(capture->form))
     return -1;
   else
     return 0;
@@ -548,67 +634,104 @@ static int try_init_v4l2(CvCaptureCAM_V4L* capture, char *deviceName)
 
 }
 
-static int autosetup_capture_mode_v4l2(CvCaptureCAM_V4L* capture)
+/* Conversion cost of the palettes per output pixel, roughly the bytes read
+   for it, raised for the RGB transform and the JPEG decoding, into gray and
+   into color output. -1 means the palette can't give that output. The
+   RetrieveProps kernels don't handle the palettes costing 100 or more, these
+   are converted to full size first, in the old probe order. */
+struct palette_cost
 {
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_BGR24) == 0)
-  {
-    capture->palette = PALETTE_BGR24;
-  }
-  else
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_YVU420) == 0)
-  {
-    capture->palette = PALETTE_YVU420;
-  }
-  else
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_YUV411P) == 0)
-  {
-    capture->palette = PALETTE_YUV411P;
-  }
-  else
+  __u32 pixelformat;
+  enum PALETTE_TYPE palette;
+  int gray, color;
+};
 
+static const struct palette_cost palette_costs[] = {
+  { V4L2_PIX_FMT_GREY,    PALETTE_GREY,    2,   -1 },
+  { V4L2_PIX_FMT_NV12,    PALETTE_NV12,    2,   3 },
+  { V4L2_PIX_FMT_YUV420,  PALETTE_YUV420,  2,   3 },
+  { V4L2_PIX_FMT_YVU420,  PALETTE_YVU420,  2,   3 },
+  { V4L2_PIX_FMT_YUYV,    PALETTE_YUYV,    4,   4 },
+  { V4L2_PIX_FMT_UYVY,    PALETTE_UYVY,    4,   4 },
+  { V4L2_PIX_FMT_SBGGR8,  PALETTE_SBGGR8,  5,   5 },
+  { V4L2_PIX_FMT_SGBRG,   PALETTE_SGBRG,   5,   5 },
+  { V4L2_PIX_FMT_BGR24,   PALETTE_BGR24,   6,   6 },
+  { V4L2_PIX_FMT_RGB24,   PALETTE_RGB24,   6,   6 },
 #ifdef HAVE_JPEG
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_MJPEG) == 0 ||
-      try_palette_v4l2(capture, V4L2_PIX_FMT_JPEG) == 0)
-  {
-    capture->palette = PALETTE_MJPEG;
-  }
-  else
+  { V4L2_PIX_FMT_MJPEG,   PALETTE_MJPEG,   20,  40 },
+  { V4L2_PIX_FMT_JPEG,    PALETTE_MJPEG,   20,  40 },
 #endif
+  { V4L2_PIX_FMT_YUV411P, PALETTE_YUV411P, 100, 100 },
+  { V4L2_PIX_FMT_SN9C10X, PALETTE_SN9C10X, 101, 101 }
+};
 
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_YUYV) == 0)
-  {
-    capture->palette = PALETTE_YUYV;
-  }
-  else if (try_palette_v4l2(capture, V4L2_PIX_FMT_UYVY) == 0)
-  {
-    capture->palette = PALETTE_UYVY;
+#define PALETTE_COSTS ((int)(sizeof(palette_costs) / sizeof(palette_costs[0])))
+
+/* Sum of the costs for the outputs in profile, -1 if the palette can't give all. */
+static int palette_profile_cost(const struct palette_cost *cost, int profile)
+{
+  int sum = 0;
+  if (profile & (1 << CS_GRAY)) {
+    if (cost->gray < 0)
+      return -1;
+    sum += cost->gray;
   }
-  else
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_SN9C10X) == 0)
-  {
-    capture->palette = PALETTE_SN9C10X;
-  } else
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_SBGGR8) == 0)
-  {
-    capture->palette = PALETTE_SBGGR8;
-  } else
-  if (try_palette_v4l2(capture, V4L2_PIX_FMT_SGBRG) == 0)
-  {
-    capture->palette = PALETTE_SGBRG;
+  if (profile & ~(1 << CS_GRAY)) {
+    if (cost->color < 0)
+      return -1;
+    sum += cost->color;
   }
-  else if (try_palette_v4l2(capture, V4L2_PIX_FMT_RGB24) == 0)
-  {
-    capture->palette = PALETTE_RGB24;
+  return sum;
+}
+
+/* True if the device lists pixelformat. Listing costs no format change, so
+   only the chosen format has to be set. Devices unable to list offer all. */
+static bool v4l2_offers(CvCaptureCAM_V4L* capture, __u32 pixelformat)
+{
+  struct v4l2_fmtdesc desc;
+  for (__u32 index = 0;; index++) {
+    CLEAR (desc);
+    desc.index = index;
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == ioctl (capture->deviceHandle, VIDIOC_ENUM_FMT, &desc))
+      return index == 0;
+    if (desc.pixelformat == pixelformat)
+      return true;
   }
-      else
-  {
-    fprintf(stderr, "VIDEOIO ERROR: V4L2: Pixel format of incoming image is unsupported by OpenCV\n");
-    icvCloseCAM_V4L(capture);
-    return -1;
+}
+
+/* Index of the cheapest palette for the profile of capture in palette_costs,
+   which the device offers and is not yet tried. -1 if none is left. */
+static int v4l2_cheapest_palette(CvCaptureCAM_V4L* capture, const bool *tried)
+{
+  int best = -1, bestCost = 0;
+  for (int i = 0; i < PALETTE_COSTS; i++) {
+    int cost = palette_profile_cost(&palette_costs[i], capture->profile);
+    if (tried[i] || cost < 0 || (best != -1 && cost >= bestCost) ||
+        !v4l2_offers(capture, palette_costs[i].pixelformat))
+      continue;
+    best = i;
+    bestCost = cost;
   }
+  return best;
+}
 
-  return 0;
+/* Sets the cheapest palette for the profile the device accepts in the given
+   size. On failure the device is left open, closing it is up to the caller. */
+static int autosetup_capture_mode_v4l2(CvCaptureCAM_V4L* capture, unsigned width, unsigned height)
+{
+  bool tried[PALETTE_COSTS] = { false };
+  int i;
+  while ((i = v4l2_cheapest_palette(capture, tried)) != -1) {
+    tried[i] = true;
+    if (try_palette_v4l2(capture, palette_costs[i].pixelformat, width, height) == 0) {
+      capture->palette = palette_costs[i].palette;
+      return 0;
+    }
+  }
 
+  fprintf(stderr, "VIDEOIO ERROR: V4L2: Pixel format of incoming image is unsupported by OpenCV\n");
+  return -1;
 }
 
 #endif /* HAVE_CAMV4L2 */
@@ -797,110 +920,226 @@ static void v4l2_scan_controls(CvCaptureCAM_V4L* capture)
 
 }
 
-static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
-{
-   int detect_v4l2 = 0;
+/* Fast open: the negotiated format, frame interval and control ranges of each
+   device are kept in the V4L2_CACHE_FILE, keyed by the identity of the device.
+   A later open of the same device sets the format with a single S_FMT instead
+   of probing palettes, sizes and controls. The palette is only the cheapest
+   for the profile it was chosen for, so the profile is restored with it. */
 
-   detect_v4l2 = try_init_v4l2(capture, deviceName);
+#define V4L2_CACHE_MAGIC "V4L2C002"
+#define V4L2_CACHE_CONTROLS 6
 
-   if (detect_v4l2 != 1) {
-       /* init of the v4l2 device is not OK */
-       return -1;
-   }
+struct v4l2_cache_entry
+{
+   /* the key, the same sizes as in v4l2_capability */
+   __u8 driver[16];
+   __u8 card[32];
+   __u8 bus_info[32];
+   __u32 pixelformat;
+   int palette;
+   /* the retrieval profile the palette was chosen for */
+   int profile;
+   __u32 width, height;
+   __u32 numerator, denominator;
+   /* present, minimum, maximum of brightness, contrast, saturation, hue, gain, exposure */
+   int controls[V4L2_CACHE_CONTROLS][3];
+};
 
-   /* starting from here, we assume we are in V4L2 mode */
-   V4L2_SUPPORT = 1;
+/* several captures may open at the same time */
+static std::mutex v4l2_cache_mutex;
 
-   /* Init V4L2 control variables */
-   capture->v4l2_brightness = 0;
-   capture->v4l2_contrast = 0;
-   capture->v4l2_saturation = 0;
-   capture->v4l2_hue = 0;
-   capture->v4l2_gain = 0;
-   capture->v4l2_exposure = 0;
+static int* v4l2_cache_control(CvCaptureCAM_V4L* capture, int i, int field)
+{
+   int *controls[V4L2_CACHE_CONTROLS][3] = {
+      { &capture->v4l2_brightness, &capture->v4l2_brightness_min, &capture->v4l2_brightness_max },
+      { &capture->v4l2_contrast, &capture->v4l2_contrast_min, &capture->v4l2_contrast_max },
+      { &capture->v4l2_saturation, &capture->v4l2_saturation_min, &capture->v4l2_saturation_max },
+      { &capture->v4l2_hue, &capture->v4l2_hue_min, &capture->v4l2_hue_max },
+      { &capture->v4l2_gain, &capture->v4l2_gain_min, &capture->v4l2_gain_max },
+      { &capture->v4l2_exposure, &capture->v4l2_exposure_min, &capture->v4l2_exposure_max }
+   };
+   return controls[i][field];
+}
 
-   capture->v4l2_brightness_min = 0;
-   capture->v4l2_contrast_min = 0;
-   capture->v4l2_saturation_min = 0;
-   capture->v4l2_hue_min = 0;
-   capture->v4l2_gain_min = 0;
-   capture->v4l2_exposure_min = 0;
+static bool v4l2_cache_matches(CvCaptureCAM_V4L* capture, const struct v4l2_cache_entry *entry)
+{
+   return !memcmp(entry->driver, capture->cap.driver, sizeof(entry->driver)) &&
+          !memcmp(entry->card, capture->cap.card, sizeof(entry->card)) &&
+          !memcmp(entry->bus_info, capture->cap.bus_info, sizeof(entry->bus_info));
+}
 
-   capture->v4l2_brightness_max = 0;
-   capture->v4l2_contrast_max = 0;
-   capture->v4l2_saturation_max = 0;
-   capture->v4l2_hue_max = 0;
-   capture->v4l2_gain_max = 0;
-   capture->v4l2_exposure_max = 0;
+/* Reads all the entries of the cache file, returns their number. */
+static int v4l2_cache_read(struct v4l2_cache_entry *entries, int max)
+{
+   FILE *file = fopen(V4L2_CACHE_FILE, "rb");
+   if (!file)
+      return 0;
 
-   capture->timestamp.tv_sec = 0;
-   capture->timestamp.tv_usec = 0;
+   char magic[sizeof(V4L2_CACHE_MAGIC) - 1];
+   int count = 0;
+   if (fread(magic, sizeof(magic), 1, file) == 1 && !memcmp(magic, V4L2_CACHE_MAGIC, sizeof(magic)))
+      count = fread(entries, sizeof(struct v4l2_cache_entry), max, file);
+   fclose(file);
+   return count;
+}
 
-   /* Scan V4L2 controls */
-   v4l2_scan_controls(capture);
+/* Looks up the device of capture, returns 1 and fills entry if found. */
+static int v4l2_cache_load(CvCaptureCAM_V4L* capture, struct v4l2_cache_entry *entry)
+{
+   if (!V4L2_CACHE_FILE[0])
+      return 0;
 
-   if ((capture->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) == 0) {
-      /* Nope. */
-      fprintf( stderr, "VIDEOIO ERROR: V4L2: device %s is unable to capture video memory.\n",deviceName);
-      icvCloseCAM_V4L(capture);
-      return -1;
-   }
+   std::lock_guard<std::mutex> lock(v4l2_cache_mutex);
+   struct v4l2_cache_entry entries[MAX_CAMERAS];
+   int count = v4l2_cache_read(entries, MAX_CAMERAS);
+   for (int i = 0; i < count; i++)
+      if (v4l2_cache_matches(capture, &entries[i])) {
+         *entry = entries[i];
+         return 1;
+      }
+   return 0;
+}
 
-   /* The following code sets the CHANNEL_NUMBER of the video input.  Some video sources
-   have sub "Channel Numbers".  For a typical V4L TV capture card, this is usually 1.
-   I myself am using a simple NTSC video input capture card that uses the value of 1.
-   If you are not in North America or have a different video standard, you WILL have to change
-   the following settings and recompile/reinstall.  This set of settings is based on
-   the most commonly encountered input video source types (like my bttv card) */
+/* Saves the current settings of capture, replacing its old entry if any. */
+static void v4l2_cache_store(CvCaptureCAM_V4L* capture)
+{
+   if (!V4L2_CACHE_FILE[0])
+      return;
+
+   struct v4l2_cache_entry entry;
+   CLEAR (entry);
+   memcpy(entry.driver, capture->cap.driver, sizeof(entry.driver));
+   memcpy(entry.card, capture->cap.card, sizeof(entry.card));
+   memcpy(entry.bus_info, capture->cap.bus_info, sizeof(entry.bus_info));
+   entry.pixelformat = capture->form.fmt.pix.pixelformat;
+   entry.palette = capture->palette;
+   entry.profile = capture->profile;
+   entry.width = capture->form.fmt.pix.width;
+   entry.height = capture->form.fmt.pix.height;
+
+   struct v4l2_streamparm parm;
+   CLEAR (parm);
+   parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+   if (0 == ioctl (capture->deviceHandle, VIDIOC_G_PARM, &parm)) {
+      entry.numerator = parm.parm.capture.timeperframe.numerator;
+      entry.denominator = parm.parm.capture.timeperframe.denominator;
+   }
+   for (int i = 0; i < V4L2_CACHE_CONTROLS; i++)
+      for (int j = 0; j < 3; j++)
+         entry.controls[i][j] = *v4l2_cache_control(capture, i, j);
+
+   std::lock_guard<std::mutex> lock(v4l2_cache_mutex);
+   struct v4l2_cache_entry entries[MAX_CAMERAS];
+   int count = v4l2_cache_read(entries, MAX_CAMERAS);
+   int i;
+   for (i = 0; i < count && !v4l2_cache_matches(capture, &entries[i]); i++)
+      ;
+   if (i == count) { /* a new device */
+      if (count == MAX_CAMERAS) { /* full, drop the oldest */
+         memmove(entries, entries + 1, (MAX_CAMERAS - 1) * sizeof(entry));
+         count--;
+      }
+      i = count++;
+   }
+   entries[i] = entry;
+
+   /* replace the file at once, so readers never see it half written */
+   char tmpName[sizeof(V4L2_CACHE_FILE) + 16];
+   snprintf(tmpName, sizeof(tmpName), "%s.%d", V4L2_CACHE_FILE, (int)getpid());
+   FILE *file = fopen(tmpName, "wb");
+   if (!file)
+      return;
+   bool ok = fwrite(V4L2_CACHE_MAGIC, sizeof(V4L2_CACHE_MAGIC) - 1, 1, file) == 1 &&
+             (int)fwrite(entries, sizeof(entry), count, file) == count;
+   ok = fclose(file) == 0 && ok;
+   if (!ok || rename(tmpName, V4L2_CACHE_FILE))
+      unlink(tmpName);
+}
 
-   if(capture->inp.index > 0) {
-       CLEAR (capture->inp);
-       capture->inp.index = CHANNEL_NUMBER;
-       /* Set only channel number to CHANNEL_NUMBER */
-       /* V4L2 have a status field from selected video mode */
-       if (-1 == ioctl (capture->deviceHandle, VIDIOC_ENUMINPUT, &capture->inp))
-       {
-         fprintf (stderr, "VIDEOIO ERROR: V4L2: Aren't able to set channel number\n");
-         icvCloseCAM_V4L (capture);
-         return -1;
-       }
-   } /* End if */
+/* Sets up the format and controls from the cache with a single S_FMT.
+   Returns 0 if the device has no entry or does not accept it any more, the
+   normal negotiation has to follow then. */
+static int v4l2_cache_apply(CvCaptureCAM_V4L* capture)
+{
+   struct v4l2_cache_entry entry;
+   if (!v4l2_cache_load(capture, &entry) || entry.profile == 0)
+      return 0;
 
-   /* Find Window info */
    CLEAR (capture->form);
    capture->form.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+   capture->form.fmt.pix.pixelformat = entry.pixelformat;
+   capture->form.fmt.pix.field = V4L2_FIELD_ANY;
+   capture->form.fmt.pix.width = entry.width;
+   capture->form.fmt.pix.height = entry.height;
+   if (-1 == ioctl (capture->deviceHandle, VIDIOC_S_FMT, &capture->form) ||
+       capture->form.fmt.pix.pixelformat != entry.pixelformat ||
+       capture->form.fmt.pix.width != entry.width ||
+       capture->form.fmt.pix.height != entry.height ||
+       !v4l2_format_packed(capture->form))
+      return 0;
+   capture->palette = (enum PALETTE_TYPE)entry.palette;
+   /* a later profile change compares with the profile of the palette */
+   capture->profile = entry.profile;
+
+   /* the driver may keep the interval across opens, S_PARM only if it did not */
+   if (entry.denominator != 0) {
+      struct v4l2_streamparm parm;
+      CLEAR (parm);
+      parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      if (-1 == ioctl (capture->deviceHandle, VIDIOC_G_PARM, &parm) ||
+          parm.parm.capture.timeperframe.numerator != entry.numerator ||
+          parm.parm.capture.timeperframe.denominator != entry.denominator) {
+         parm.parm.capture.timeperframe.numerator = entry.numerator;
+         parm.parm.capture.timeperframe.denominator = entry.denominator;
+         ioctl (capture->deviceHandle, VIDIOC_S_PARM, &parm);
+      }
+   }
 
-   if (-1 == ioctl (capture->deviceHandle, VIDIOC_G_FMT, &capture->form)) {
-       fprintf( stderr, "VIDEOIO ERROR: V4L2: Could not obtain specifics of capture window.\n\n");
-       icvCloseCAM_V4L(capture);
-       return -1;
+   for (int i = 0; i < V4L2_CACHE_CONTROLS; i++)
+      for (int j = 0; j < 3; j++)
+         *v4l2_cache_control(capture, i, j) = entry.controls[i][j];
+   return 1;
+}
+
+/* Stops the stream and unmaps all the buffers, the spare one is freed.
+   Releasing again does nothing. */
+static void v4l2_release_buffers(CvCaptureCAM_V4L *capture)
+{
+   /* the recorder may still read a leased buffer */
+   if (capture->recorder)
+       capture->recorder->flush();
+   capture->recordedIndex = -1;
+
+   capture->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+   if (capture->deviceHandle != -1 &&
+       -1 == ioctl(capture->deviceHandle, VIDIOC_STREAMOFF, &capture->type)) {
+       perror ("Unable to stop the stream.");
    }
 
-   if (V4L2_SUPPORT == 0)
+   for (unsigned int n_buffers_ = 0; n_buffers_ < capture->req.count; ++n_buffers_)
    {
+       if (-1 == munmap (capture->buffers[n_buffers_].start, capture->buffers[n_buffers_].length)) {
+           perror ("munmap");
+       }
+       capture->buffers[n_buffers_].leases = 0;
    }
+   capture->req.count = 0;
+   capture->leasedIndex = -1;
 
-   if (autosetup_capture_mode_v4l2(capture) == -1)
-       return -1;
-
-   icvSetVideoSize(capture, DEFAULT_V4L_WIDTH, DEFAULT_V4L_HEIGHT);
-
-   unsigned int min;
-
-   /* Buggy driver paranoia. */
-   min = capture->form.fmt.pix.width * 2;
-
-   if (capture->form.fmt.pix.bytesperline < min)
-       capture->form.fmt.pix.bytesperline = min;
-
-   min = capture->form.fmt.pix.bytesperline * capture->form.fmt.pix.height;
-
-   if (capture->form.fmt.pix.sizeimage < min)
-       capture->form.fmt.pix.sizeimage = min;
+   if (capture->buffers[MAX_V4L_BUFFERS].start)
+   {
+       free(capture->buffers[MAX_V4L_BUFFERS].start);
+       capture->buffers[MAX_V4L_BUFFERS].start = 0;
+   }
+}
 
+/* Requests buffer_number mmap buffers from the driver, or as many as it can
+   give, maps them and allocates the spare buffer. On failure nothing stays
+   mapped and the device is left open, closing it is up to the caller. */
+static int v4l2_request_buffers(CvCaptureCAM_V4L *capture, const char *deviceName, unsigned int buffer_number)
+{
    CLEAR (capture->req);
 
-   unsigned int buffer_number = DEFAULT_V4L_BUFFERS;
 
    try_again:
 
@@ -916,8 +1155,7 @@ static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
        } else {
          perror ("VIDIOC_REQBUFS");
        }
-       /* free capture, and returns an error code */
-       icvCloseCAM_V4L (capture);
+       capture->req.count = 0;
        return -1;
    }
 
@@ -926,9 +1164,7 @@ static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
        if (buffer_number == 1)
        {
            fprintf (stderr, "Insufficient buffer memory on %s\n", deviceName);
-
-           /* free capture, and returns an error code */
-           icvCloseCAM_V4L (capture);
+           capture->req.count = 0;
            return -1;
        } else {
          buffer_number--;
@@ -938,6 +1174,7 @@ static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
        }
    }
 
+   unsigned int n_buffers;
    for (n_buffers = 0; n_buffers < capture->req.count; ++n_buffers)
    {
        struct v4l2_buffer buf;
@@ -951,8 +1188,9 @@ static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
        if (-1 == ioctl (capture->deviceHandle, VIDIOC_QUERYBUF, &buf)) {
            perror ("VIDIOC_QUERYBUF");
 
-           /* free capture, and returns an error code */
-           icvCloseCAM_V4L (capture);
+           /* unmap the buffers mapped so far */
+           capture->req.count = n_buffers;
+           v4l2_release_buffers (capture);
            return -1;
        }
 
@@ -967,8 +1205,9 @@ static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
        if (MAP_FAILED == capture->buffers[n_buffers].start) {
            perror ("mmap");
 
-           /* free capture, and returns an error code */
-           icvCloseCAM_V4L (capture);
+           /* unmap the buffers mapped so far */
+           capture->req.count = n_buffers;
+           v4l2_release_buffers (capture);
            return -1;
        }
 
@@ -978,6 +1217,213 @@ static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
        }
    }
 
+   return 1;
+}
+
+/* Changes the number of buffers queued to the driver. Streaming restarts
+   with the next grab. If the driver refuses the new count the old one is
+   requested again, and if even that fails the capture is closed, so later
+   grabs fail. */
+static int v4l2_set_buffer_count(CvCaptureCAM_V4L *capture, int count)
+{
+   if (count < 1)
+       count = 1;
+   if (count > MAX_V4L_BUFFERS)
+       count = MAX_V4L_BUFFERS;
+   if ((unsigned int)count == capture->req.count)
+       return 0;
+
+   unsigned int previous = capture->req.count;
+   v4l2_release_buffers(capture);
+   capture->FirstCapture = 1;
+   if (v4l2_request_buffers(capture, "the V4L2 device", count) != -1)
+       return 0;
+   if (v4l2_request_buffers(capture, "the V4L2 device", previous) == -1)
+       icvCloseCAM_V4L(capture);
+   return -1;
+}
+
+/* Sets the palette palette_costs[forced], or the cheapest one for the
+   profile if forced is -1, keeping the size, and requests the buffers again.
+   If the new format can not be set up the old one is restored, and if even
+   that fails the capture is closed, so later grabs fail. */
+static int v4l2_change_palette(CvCaptureCAM_V4L *capture, int forced)
+{
+   struct v4l2_format form = capture->form;
+   PALETTE_TYPE palette = capture->palette;
+   unsigned count = capture->req.count;
+   v4l2_release_buffers(capture);
+   capture->FirstCapture = 1;
+   int set;
+   if (forced == -1) {
+       set = autosetup_capture_mode_v4l2(capture, form.fmt.pix.width, form.fmt.pix.height);
+   } else {
+       set = try_palette_v4l2(capture, palette_costs[forced].pixelformat, form.fmt.pix.width, form.fmt.pix.height);
+       if (set == 0)
+           capture->palette = palette_costs[forced].palette;
+   }
+   if (set != -1 && v4l2_request_buffers(capture, "the V4L2 device", count) != -1) {
+       /* a forced palette serves this run only, the next open ranks again */
+       if (forced == -1)
+           v4l2_cache_store(capture);
+       return 0;
+   }
+
+   if (try_palette_v4l2(capture, form.fmt.pix.pixelformat, form.fmt.pix.width, form.fmt.pix.height) == -1) {
+       icvCloseCAM_V4L(capture);
+       return -1;
+   }
+   capture->form = form;
+   capture->palette = palette;
+   if (v4l2_request_buffers(capture, "the V4L2 device", count) == -1)
+       icvCloseCAM_V4L(capture);
+   return -1;
+}
+
+/* Chooses the palette again for a new retrieval profile, keeping the size.
+   The format changes only if an other palette became the cheapest, and not
+   at all while recording, as the recording needs YUYV. */
+static int v4l2_set_profile(CvCaptureCAM_V4L *capture, int profile)
+{
+   if (profile == 0 || profile == capture->profile)
+       return 0;
+   int oldProfile = capture->profile;
+   capture->profile = profile;
+   if (capture->recorder)
+       return 0;
+
+   bool tried[PALETTE_COSTS] = { false };
+   int best = v4l2_cheapest_palette(capture, tried);
+   if (best == -1 || palette_costs[best].palette == capture->palette)
+       return 0;
+
+   if (v4l2_change_palette(capture, -1) == -1) {
+       capture->profile = oldProfile;
+       return -1;
+   }
+   return 0;
+}
+
+static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
+{
+   int detect_v4l2 = 0;
+
+   detect_v4l2 = try_init_v4l2(capture, deviceName);
+
+   if (detect_v4l2 != 1) {
+       /* init of the v4l2 device is not OK */
+       return -1;
+   }
+
+   /* starting from here, we assume we are in V4L2 mode */
+   capture->v4l2Support = 1;
+
+   /* Init V4L2 control variables */
+   capture->v4l2_brightness = 0;
+   capture->v4l2_contrast = 0;
+   capture->v4l2_saturation = 0;
+   capture->v4l2_hue = 0;
+   capture->v4l2_gain = 0;
+   capture->v4l2_exposure = 0;
+
+   capture->v4l2_brightness_min = 0;
+   capture->v4l2_contrast_min = 0;
+   capture->v4l2_saturation_min = 0;
+   capture->v4l2_hue_min = 0;
+   capture->v4l2_gain_min = 0;
+   capture->v4l2_exposure_min = 0;
+
+   capture->v4l2_brightness_max = 0;
+   capture->v4l2_contrast_max = 0;
+   capture->v4l2_saturation_max = 0;
+   capture->v4l2_hue_max = 0;
+   capture->v4l2_gain_max = 0;
+   capture->v4l2_exposure_max = 0;
+
+   capture->timestamp.tv_sec = 0;
+   capture->timestamp.tv_usec = 0;
+
+   capture->leasing = 0;
+   capture->leasedIndex = -1;
+   capture->recordedIndex = -1;
+   capture->drainQueue = 0;
+   capture->sequenceValid = 0;
+   capture->dropped = 0;
+   capture->monotonic = 0;
+   capture->profile = (1 << CS_GRAY) | (1 << CS_YCRCB);
+
+   /* a known device starts with its last format and controls, no probing needed */
+   int cached = v4l2_cache_apply(capture);
+
+   /* Scan V4L2 controls */
+   if (!cached)
+       v4l2_scan_controls(capture);
+
+   if ((capture->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) == 0) {
+      /* Nope. */
+      fprintf( stderr, "VIDEOIO ERROR: V4L2: device %s is unable to capture video memory.\n",deviceName);
+      icvCloseCAM_V4L(capture);
+      return -1;
+   }
+
+   /* The following code sets the CHANNEL_NUMBER of the video input.  Some video sources
+   have sub "Channel Numbers".  For a typical V4L TV capture card, this is usually 1.
+   I myself am using a simple NTSC video input capture card that uses the value of 1.
+   If you are not in North America or have a different video standard, you WILL have to change
+   the following settings and recompile/reinstall.  This set of settings is based on
+   the most commonly encountered input video source types (like my bttv card) */
+
+   if(capture->inp.index > 0) {
+       CLEAR (capture->inp);
+       capture->inp.index = CHANNEL_NUMBER;
+       /* Set only channel number to CHANNEL_NUMBER */
+       /* V4L2 have a status field from selected video mode */
+       if (-1 == ioctl (capture->deviceHandle, VIDIOC_ENUMINPUT, &capture->inp))
+       {
+         fprintf (stderr, "VIDEOIO ERROR: V4L2: Aren't able to set channel number\n");
+         icvCloseCAM_V4L (capture);
+         return -1;
+       }
+   } /* End if */
+
+   if (!cached) {
+       /* Find Window info */
+       CLEAR (capture->form);
+       capture->form.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+       if (-1 == ioctl (capture->deviceHandle, VIDIOC_G_FMT, &capture->form)) {
+           fprintf( stderr, "VIDEOIO ERROR: V4L2: Could not obtain specifics of capture window.\n\n");
+           icvCloseCAM_V4L(capture);
+           return -1;
+       }
+
+       if (autosetup_capture_mode_v4l2(capture, DEFAULT_V4L_WIDTH, DEFAULT_V4L_HEIGHT) == -1) {
+           icvCloseCAM_V4L(capture);
+           return -1;
+       }
+
+       /* stores the result in the cache, too */
+       icvSetVideoSize(capture, DEFAULT_V4L_WIDTH, DEFAULT_V4L_HEIGHT);
+   }
+
+   unsigned int min;
+
+   /* Buggy driver paranoia. */
+   min = capture->form.fmt.pix.width * 2;
+
+   if (capture->form.fmt.pix.bytesperline < min)
+       capture->form.fmt.pix.bytesperline = min;
+
+   min = capture->form.fmt.pix.bytesperline * capture->form.fmt.pix.height;
+
+   if (capture->form.fmt.pix.sizeimage < min)
+       capture->form.fmt.pix.sizeimage = min;
+
+   if (v4l2_request_buffers(capture, deviceName, DEFAULT_V4L_BUFFERS) == -1) {
+       icvCloseCAM_V4L(capture);
+       return -1;
+   }
+
    /* Set up Image data */
    cvInitImageHeader( &capture->frame,
                       cvSize( capture->form.fmt.pix.width,
@@ -985,6 +1431,7 @@ static int _capture_V4L2 (CvCaptureCAM_V4L *capture, char *deviceName)
                       IPL_DEPTH_8U, 3, IPL_ORIGIN_TL, 4 );
    /* Allocate space for RGBA data */
    capture->frame.imageData = (char *)cvAlloc(capture->frame.imageSize);
+   capture->frameCapacity = capture->frame.imageSize;
 
    return 1;
 }; /* End _capture_V4L2 */
@@ -1107,6 +1554,7 @@ static int _capture_V4L (CvCaptureCAM_V4L *capture, char *deviceName)
                       IPL_DEPTH_8U, 3, IPL_ORIGIN_TL, 4 );
    /* Allocate space for RGBA data */
    capture->frame.imageData = (char *)cvAlloc(capture->frame.imageSize);
+   capture->frameCapacity = capture->frame.imageSize;
 
    return 1;
 }; /* End _capture_V4L */
@@ -1115,14 +1563,12 @@ static int _capture_V4L (CvCaptureCAM_V4L *capture, char *deviceName)
 
 static CvCaptureCAM_V4L * icvCaptureFromCAM_V4L (int index)
 {
-   static int autoindex;
-   autoindex = 0;
+   int autoindex = 0;
 
    char deviceName[MAX_DEVICE_DRIVER_NAME];
 
-   if (!numCameras)
-      icvInitCapture_V4L(); /* Havent called icvInitCapture yet - do it now! */
-   if (!numCameras)
+   int indexList = icvInitCapture_V4L();
+   if (!indexList)
      return NULL; /* Are there any /dev/video input sources? */
 
    //search index in indexList
@@ -1146,7 +1592,6 @@ static CvCaptureCAM_V4L * icvCaptureFromCAM_V4L (int index)
      if (autoindex==MAX_CAMERAS)
     return NULL;
      index=autoindex;
-     autoindex++;// i can recall icvOpenCAM_V4l with index=-1 for next camera
    }
    /* Print the CameraNumber at the end of the string with a width of one character */
    sprintf(deviceName, "/dev/video%1d", index);
@@ -1160,7 +1605,7 @@ static CvCaptureCAM_V4L * icvCaptureFromCAM_V4L (int index)
 #ifdef HAVE_CAMV4L2
    if (_capture_V4L2 (capture, deviceName) == -1) {
        icvCloseCAM_V4L(capture);
-       V4L2_SUPPORT = 0;
+       capture->v4l2Support = 0;
 #endif  /* HAVE_CAMV4L2 */
 #ifdef HAVE_CAMV4L
        if (_capture_V4L (capture, deviceName) == -1) {
@@ -1170,7 +1615,7 @@ static CvCaptureCAM_V4L * icvCaptureFromCAM_V4L (int index)
 #endif  /* HAVE_CAMV4L */
 #ifdef HAVE_CAMV4L2
    } else {
-       V4L2_SUPPORT = 1;
+       capture->v4l2Support = 1;
    }
 #endif  /* HAVE_CAMV4L2 */
 
@@ -1179,6 +1624,48 @@ static CvCaptureCAM_V4L * icvCaptureFromCAM_V4L (int index)
 
 #ifdef HAVE_CAMV4L2
 
+/* Takes one more lease on a dequeued buffer. The grab and the recorder lease
+   the same buffer independently, either may drop its lease first. */
+static void v4l2_lease_acquire(CvCaptureCAM_V4L* capture, int index) {
+    capture->buffers[index].leases++;
+}
+
+/* Drops a lease on a dequeued buffer. The buffer goes back to the queue
+   when the last lease is dropped. The spare buffer is never leased. */
+static void v4l2_lease_release(CvCaptureCAM_V4L* capture, int index) {
+    if (index < 0 || index >= MAX_V4L_BUFFERS || capture->buffers[index].leases <= 0)
+        return;
+
+    if (--capture->buffers[index].leases == 0) {
+        struct v4l2_buffer buf;
+
+        CLEAR (buf);
+
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = index;
+
+        if (-1 == ioctl (capture->deviceHandle, VIDIOC_QBUF, &buf))
+            perror ("VIDIOC_QBUF");
+    }
+}
+
+/* Stops the recording once the recorder wrote the frame it still holds,
+   its buffer goes back to the queue then. */
+static void v4l2_stop_recording(CvCaptureCAM_V4L* capture) {
+    if (!capture->recorder)
+        return;
+
+    delete capture->recorder;
+    capture->recorder = NULL;
+    v4l2_lease_release(capture, capture->recordedIndex);
+    capture->recordedIndex = -1;
+    if (capture->recordSkipped)
+        fprintf( stderr, "VIDEOIO WARNING: V4L2: %lu frames not recorded, the disk could not keep up\n",
+                 capture->recordSkipped);
+    capture->recordSkipped = 0;
+}
+
 static int read_frame_v4l2(CvCaptureCAM_V4L* capture) {
     struct v4l2_buffer buf;
 
@@ -1211,15 +1698,87 @@ static int read_frame_v4l2(CvCaptureCAM_V4L* capture) {
 
    assert(buf.index < capture->req.count);
 
-   memcpy(capture->buffers[MAX_V4L_BUFFERS].start,
-      capture->buffers[buf.index].start,
-      capture->buffers[MAX_V4L_BUFFERS].length );
-   capture->bufferIndex = MAX_V4L_BUFFERS;
-   //printf("got data in buff %d, len=%d, flags=0x%X, seq=%d, used=%d)\n",
-   //	  buf.index, buf.length, buf.flags, buf.sequence, buf.bytesused);
+   if (capture->drainQueue) {
+       /* take newer frames as long as they are ready, the older ones go
+          back to the queue at once */
+       struct v4l2_buffer newer;
+
+       for (;;) {
+           CLEAR (newer);
+
+           newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+           newer.memory = V4L2_MEMORY_MMAP;
+
+           if (-1 == ioctl (capture->deviceHandle, VIDIOC_DQBUF, &newer))
+               break;
 
-   if (-1 == ioctl (capture->deviceHandle, VIDIOC_QBUF, &buf))
-       perror ("VIDIOC_QBUF");
+           if (-1 == ioctl (capture->deviceHandle, VIDIOC_QBUF, &buf))
+               perror ("VIDIOC_QBUF");
+           buf = newer;
+       }
+   }
+
+   if (capture->sequenceValid && buf.sequence > capture->sequence + 1)
+       capture->dropped += buf.sequence - capture->sequence - 1;
+   capture->sequence = buf.sequence;
+   capture->sequenceValid = 1;
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+   capture->monotonic = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+#endif
+
+   if (capture->recorder) {
+       /* the recorder writes on its own thread, a frame arriving while it is
+          still busy is not recorded */
+       if (capture->recordedIndex != -1 && !capture->recorder->busy()) {
+           v4l2_lease_release(capture, capture->recordedIndex);
+           capture->recordedIndex = -1;
+       }
+
+       RawFrameEntry entry;
+       entry.timestampUs = capture->monotonic ?
+           (int64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec : 0;
+       entry.sequence = buf.sequence;
+       entry.dropped = capture->dropped;
+       /* the recorder leases the driver buffer if one stays queued even
+          with the grab and the recorder holding one each, else it copies */
+       unsigned int held = capture->leasing ? 2 : 1;
+       bool lease = capture->req.count > held;
+       if (buf.bytesused != capture->recorder->frameSize()) {
+           fprintf( stderr, "VIDEOIO ERROR: V4L2: frame size changed, recording stopped\n");
+           v4l2_stop_recording(capture);
+       } else if (capture->recorder->post(capture->buffers[buf.index].start, entry, !lease)) {
+           if (lease) {
+               v4l2_lease_acquire(capture, buf.index);
+               capture->recordedIndex = buf.index;
+           }
+       } else {
+           capture->recordSkipped++;
+       }
+   }
+
+   /* the previous frame is replaced now, drop its lease */
+   v4l2_lease_release(capture, capture->leasedIndex);
+   capture->leasedIndex = -1;
+
+   if (capture->leasing) {
+       /* the buffer stays out of the queue until its last lease is dropped,
+          retrieval converts straight from it */
+       v4l2_lease_acquire(capture, buf.index);
+       capture->leasedIndex = buf.index;
+       capture->bufferIndex = buf.index;
+   } else {
+       memcpy(capture->buffers[MAX_V4L_BUFFERS].start,
+          capture->buffers[buf.index].start,
+          capture->buffers[MAX_V4L_BUFFERS].length );
+       capture->bufferIndex = MAX_V4L_BUFFERS;
+       //printf("got data in buff %d, len=%d, flags=0x%X, seq=%d, used=%d)\n",
+       //	  buf.index, buf.length, buf.flags, buf.sequence, buf.bytesused);
+
+       /* queued again now, unless the recorder still reads it */
+       if (capture->recordedIndex != (int)buf.index &&
+           -1 == ioctl (capture->deviceHandle, VIDIOC_QBUF, &buf))
+           perror ("VIDIOC_QBUF");
+   }
 
    //set timestamp in capture struct to be timestamp of most recent frame
    capture->timestamp = buf.timestamp;
@@ -1271,6 +1830,9 @@ static void mainloop_v4l2(CvCaptureCAM_V4L* capture) {
 
 static int icvGrabFrameCAM_V4L(CvCaptureCAM_V4L* capture) {
 
+   if (capture->deviceHandle == -1)
+      return 0;
+
    if (capture->FirstCapture) {
       /* Some general initialization must take place the first time through */
 
@@ -1280,7 +1842,7 @@ static int icvGrabFrameCAM_V4L(CvCaptureCAM_V4L* capture) {
 #ifdef HAVE_CAMV4L2
 
 #ifdef HAVE_CAMV4L
-      if (V4L2_SUPPORT == 1)
+      if (capture->v4l2Support == 1)
 #endif
       {
 
@@ -1301,7 +1863,12 @@ static int icvGrabFrameCAM_V4L(CvCaptureCAM_V4L* capture) {
               perror ("VIDIOC_QBUF");
               return 0;
           }
+          capture->buffers[capture->bufferIndex].leases = 0;
         }
+        capture->leasedIndex = -1;
+        capture->recordedIndex = -1;
+        /* the driver restarts the sequence with the stream */
+        capture->sequenceValid = 0;
 
         /* enable the streaming */
         capture->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -1338,7 +1905,7 @@ static int icvGrabFrameCAM_V4L(CvCaptureCAM_V4L* capture) {
 #endif /* HAVE_CAMV4L */
 
 #if defined(V4L_ABORT_BADJPEG) && defined(HAVE_CAMV4L2)
-     if (V4L2_SUPPORT == 1)
+     if (capture->v4l2Support == 1)
      {
         // skip first frame. it is often bad -- this is unnotied in traditional apps,
         //  but could be fatal if bad jpeg is enabled
@@ -1352,7 +1919,7 @@ static int icvGrabFrameCAM_V4L(CvCaptureCAM_V4L* capture) {
 
 #ifdef HAVE_CAMV4L2
 
-   if (V4L2_SUPPORT == 1)
+   if (capture->v4l2Support == 1)
    {
 
      mainloop_v4l2(capture);
@@ -1694,215 +2261,114 @@ yuyv_to_rgb24 (int width, int height, unsigned char *src, unsigned char *dst)
    }
 }
 
-static void yuyv2gray(int width, int height, unsigned char *src, unsigned char *dst, cv::Rect &region) {
-    register unsigned char *s = src + (width << 1) * region.y + (region.x << 1);
-    register unsigned char *d = dst;
-	int diff = (width - region.width) << 1;
-	for(int i = region.height - 1; i >= 0; i--) {
-		for(register int j = region.width - 1; j >= 0; j--) {
-			*d++ = *s;
-			s += 2;
-		}
-		s+= diff;
-	}
-}
-
-static void yuyv2ycrcb(int width, int height, unsigned char *src, unsigned char *dst, cv::Rect &region) {
-    register unsigned char *s = src + (width << 1) * region.y + (region.x << 1);
-    register unsigned char *d = dst;
-	bool oddStart = (region.x % 2) == 1;
-	int diff = (width - region.width) << 1;
-	register unsigned char u, v;
-	for(int i = region.height - 1; i >= 0; i--) {
-		if(oddStart) {
-			u = s[-1];
-			v = s[1];
-		}
-		for(register int j = region.width - 1; j >=0; j--) {
-			if(j % 2 == 0) {
-				*d++ = *s++;
-				u = *d++ = *s++;
-				v = *d++ = s[1];
-			}
-			else {
-				*d++ = *s++;
-				*d++ = u;
-				*d++ = v;
-				s++;
-			}
-		}
-		s+= diff;
-	}
-}
-
-static void yuyv2bgr(int width, int height, unsigned char *src, unsigned char *dst, cv::Rect &region) {
-	yuyv2ycrcb(width, height, src, dst, region);
-}
+#endif //HAVE_CAMV4L2
 
-static int logTwo(unsigned n) {
-	int sh = 0;
-	while(n > 1) {
-		n >>= 1;
-		sh++;
-	}
-	return sh;
-}
-
-static void yuyv2gray(int width, int height, unsigned char *src, unsigned char *dst, unsigned denom) {
-    unsigned char *s = src;
-    register unsigned char *d = dst;
-	int dw = width / denom;
-	int dh = height / denom;
-	int rw = (width % denom) << 1;
-	int sw = (width * (denom - 1)) << 1;
-	register int ssd = (width - denom) << 1;
-	register int d2 = denom << 1;
-	register unsigned sh = logTwo(denom) << 1;
-	for(int i = dh - 1; i >= 0; i--) {
-		for(int j = dw - 1; j >= 0; j--) {
-			register unsigned sum = 0;
-			register unsigned char *ss = s;
-			for(register int k = 0; k < denom; k++) {
-				for(register int l = 0; l < denom; l++) {
-					sum += *ss;
-					ss += 2;
-				}
-				ss += ssd;
-			}
-			*d++ = sum >> sh;
-			s += d2;
-		}
-		s+= rw + sw;
-	}
-}
+#ifdef HAVE_JPEG
 
-static void yuyv2ycrcb(int width, int height, unsigned char *src, unsigned char *dst, unsigned denom) {
-    unsigned char *s = src;
-    register unsigned char *d = dst;
-	int denom2 = denom >> 1;
-	int dw = width / denom;
-	int dh = height / denom;
-	int rw = (width % denom) << 1;
-	int sw = (width * (denom - 1)) << 1;
-	int ssd = (width - denom) << 1;
-	int d2 = denom << 1;
-	register unsigned sh = logTwo(denom) << 1;
-	register unsigned sh2 = sh - 1;
-	register int bias = 128 << sh2;
-	for(int i = dh - 1; i >= 0; i--) {
-		for(int j = dw - 1; j >= 0; j--) {
-			register unsigned sumY = 0;
-			register int sumU = 0;
-			register int sumV = 0;
-			register unsigned char *ss = s;
-			for(register int k = denom - 1; k >= 0; k--) {
-				for(register int l = denom2 - 1; l >= 0; l--) {
-					sumY += *ss++;
-					sumU += *ss++;
-					sumY += *ss++;
-					sumV += *ss++;
-				}
-				ss += ssd;
-			}
-			*d++ = sumY >> sh;
-			*d++ = ((sumU - bias) >> sh2) + 128;
-			*d++ = ((sumV - bias) >> sh2) + 128;
-			s += d2;
-		}
-		s+= rw + sw;
-	}
-}
+struct mjpeg_error_mgr
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
 
-static void yuyv2bgr(int width, int height, unsigned char *src, unsigned char *dst, unsigned denom) {
-	yuyv2ycrcb(width, height, src, dst, denom);
+static void mjpeg_error_exit (j_common_ptr cinfo)
+{
+  longjmp(((struct mjpeg_error_mgr*)cinfo->err)->jump, 1);
 }
 
-static void yuyv_to_propsDefined(int width, int height, unsigned char *src, unsigned char *dst, unsigned denominator, cv::Rect &region, RetrColorspace colorspace) {
-	if(denominator == 1) {
-		switch(colorspace) {
-		case CS_GRAY:
-			yuyv2gray(width, height, src, dst, region);
-		break;
-		case CS_YCRCB:
-			yuyv2ycrcb(width, height, src, dst, region);
-		break;
-		default:
-			yuyv2bgr(width, height, src, dst, region);
-		}
-	}
-	else {
-		switch(colorspace) {
-		case CS_GRAY:
-			yuyv2gray(width, height, src, dst, denominator);
-		break;
-		case CS_YCRCB:
-			yuyv2ycrcb(width, height, src, dst, denominator);
-		break;
-		default:
-			yuyv2bgr(width, height, src, dst, denominator);
-		}
-	}
+static void mjpeg_output_message (j_common_ptr)
+{
 }
 
-static void
-uyvy_to_rgb24 (int width, int height, unsigned char *src, unsigned char *dst)
+/* Decodes the grabbed MJPEG frame into a RetrieveProps target. libjpeg scales
+   by 1/2, 1/4 and 1/8 in the DCT domain and gives only the luma for gray
+   output, so the small frames of the still check cost a fraction of a full
+   decode. Color output comes as Y, Cb, Cr like from the other kernels. For a
+   region, decoding stops after its last row. */
+static bool
+mjpeg_decode (CvCaptureCAM_V4L* capture, RetrieveTarget &target)
 {
-   unsigned char *s;
-   unsigned char *d;
-   int l, c;
-   int r, g, b, cr, cg, cb, y1, y2;
-
-   l = height;
-   s = src;
-   d = dst;
-   while (l--) {
-      c = width >> 1;
-      while (c--) {
-         cb = ((*s - 128) * 454) >> 8;
-         cg = (*s++ - 128) * 88;
-         y1 = *s++;
-         cr = ((*s - 128) * 359) >> 8;
-         cg = (cg + (*s++ - 128) * 183) >> 8;
-         y2 = *s++;
-
-         r = y1 + cr;
-         b = y1 + cb;
-         g = y1 - cg;
-         SAT(r);
-         SAT(g);
-         SAT(b);
-
-     *d++ = b;
-     *d++ = g;
-     *d++ = r;
-
-         r = y2 + cr;
-         b = y2 + cb;
-         g = y2 - cg;
-         SAT(r);
-         SAT(g);
-         SAT(b);
-
-     *d++ = b;
-     *d++ = g;
-     *d++ = r;
-      }
-   }
+  static thread_local std::vector<unsigned char> line;
+  struct jpeg_decompress_struct cinfo;
+  struct mjpeg_error_mgr err;
+
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = mjpeg_error_exit;
+  err.pub.output_message = mjpeg_output_message;
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char*)capture->buffers[capture->bufferIndex].start,
+               capture->buffers[capture->bufferIndex].length);
+  jpeg_read_header(&cinfo, TRUE);
+  if (cinfo.image_width != capture->form.fmt.pix.width ||
+      cinfo.image_height != capture->form.fmt.pix.height) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = target.denominator;
+  cinfo.out_color_space = target.colorspace == CS_GRAY ? JCS_GRAYSCALE : JCS_YCbCr;
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+
+  /* the scaled size is rounded up, the target one down */
+  unsigned top = target.denominator == 1 ? target.region.y : 0;
+  unsigned left = (target.denominator == 1 ? target.region.x : 0) * target.channels;
+  unsigned lineLen = target.width * target.channels;
+  line.resize(cinfo.output_width * cinfo.output_components);
+  JSAMPROW row = line.data();
+  unsigned char *dst = target.dst;
+  while (cinfo.output_scanline < top + target.height) {
+    bool wanted = cinfo.output_scanline >= top;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    if (wanted) {
+      memcpy(dst, row + left, lineLen);
+      dst += lineLen;
+    }
+  }
+  bool ok = true;
+#ifdef V4L_ABORT_BADJPEG
+  ok = err.pub.num_warnings == 0;
+#endif
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return ok;
 }
-#endif //HAVE_CAMV4L2
 
-#ifdef HAVE_JPEG
-
-/* convert from mjpeg to rgb24 */
+/* Other scales, downsampled regions, planar, oriented and remapped outputs are
+   converted from a full size decode of the rows down to the bottom of the region. */
 static bool
-mjpeg_to_rgb24 (int width, int height,
-        unsigned char *src, int length,
-        unsigned char *dst)
+mjpeg_to_target (CvCaptureCAM_V4L* capture, RetrieveTarget &target)
 {
-  cv::Mat temp=cv::imdecode(cv::Mat(std::vector<uchar>(src, src + length)), 1);
-  if( !temp.data || temp.cols != width || temp.rows != height )
+  static thread_local std::vector<unsigned char> decoded;
+  int width = capture->form.fmt.pix.width;
+  int height = capture->form.fmt.pix.height;
+  unsigned d = target.denominator;
+  bool planar = target.colorspace == CS_YCRCB_422P || target.colorspace == CS_YCRCB_420P;
+  bool plain = !planar && target.orientation == OR_NONE && target.remap == NULL;
+  if (plain && (d == 1 || ((d & (d - 1)) == 0 && d <= 8 && target.region == cv::Rect(0, 0, width, height))))
+    return mjpeg_decode(capture, target);
+
+  RetrieveTarget full = target;
+  if (planar) {
+    full.colorspace = CS_YCRCB;
+    full.channels = 3;
+  }
+  full.denominator = 1;
+  full.orientation = OR_NONE;
+  full.remap = NULL;
+  full.region = cv::Rect(0, 0, width, target.region.y + target.region.height);
+  full.width = full.region.width;
+  full.height = full.rows = full.region.height;
+  decoded.resize(full.width * full.height * full.channels);
+  full.dst = decoded.data();
+  if (!mjpeg_decode(capture, full))
     return false;
-  memcpy(dst, temp.data, width*height*3);
+  RetrieveSource src = { target.colorspace == CS_GRAY ? RL_GREY : RL_YUV24, full.width, full.height, decoded.data() };
+  frame_to_targets(src, &target, 1);
   return true;
 }
 
@@ -1990,106 +2456,6 @@ static void bayer2rgb24(long int WIDTH, long int HEIGHT, unsigned char *src, uns
 
 }
 
-// SGBRG to RGB24
-// for some reason, red and blue needs to be swapped
-// at least for  046d:092f Logitech, Inc. QuickCam Express Plus to work
-//see: http://www.siliconimaging.com/RGB%20Bayer.htm
-//and 4.6 at http://tldp.org/HOWTO/html_single/libdc1394-HOWTO/
-static void sgbrg2rgb24(long int WIDTH, long int HEIGHT, unsigned char *src, unsigned char *dst)
-{
-    long int i;
-    unsigned char *rawpt, *scanpt;
-    long int size;
-
-    rawpt = src;
-    scanpt = dst;
-    size = WIDTH*HEIGHT;
-
-    for ( i = 0; i < size; i++ )
-    {
-        if ( (i/WIDTH) % 2 == 0 ) //even row
-        {
-            if ( (i % 2) == 0 ) //even pixel
-            {
-                if ( (i > WIDTH) && ((i % WIDTH) > 0) )
-                {
-                    *scanpt++ = (*(rawpt-1)+*(rawpt+1))/2;       /* R */
-                    *scanpt++ = *(rawpt);                        /* G */
-                    *scanpt++ = (*(rawpt-WIDTH) + *(rawpt+WIDTH))/2;      /* B */
-                } else
-                {
-                  /* first line or left column */
-
-                  *scanpt++ = *(rawpt+1);           /* R */
-                  *scanpt++ = *(rawpt);             /* G */
-                  *scanpt++ =  *(rawpt+WIDTH);      /* B */
-                }
-            } else //odd pixel
-            {
-                if ( (i > WIDTH) && ((i % WIDTH) < (WIDTH-1)) )
-                {
-                    *scanpt++ = *(rawpt);       /* R */
-                    *scanpt++ = (*(rawpt-1)+*(rawpt+1)+*(rawpt-WIDTH)+*(rawpt+WIDTH))/4; /* G */
-                    *scanpt++ = (*(rawpt-WIDTH-1) + *(rawpt-WIDTH+1) + *(rawpt+WIDTH-1) + *(rawpt+WIDTH+1))/4;      /* B */
-                } else
-                {
-                    /* first line or right column */
-
-                    *scanpt++ = *(rawpt);       /* R */
-                    *scanpt++ = (*(rawpt-1)+*(rawpt+WIDTH))/2; /* G */
-                    *scanpt++ = *(rawpt+WIDTH-1);      /* B */
-                }
-            }
-        } else
-        { //odd row
-            if ( (i % 2) == 0 ) //even pixel
-            {
-                if ( (i < (WIDTH*(HEIGHT-1))) && ((i % WIDTH) > 0) )
-                {
-                    *scanpt++ =  (*(rawpt-WIDTH-1)+*(rawpt-WIDTH+1)+*(rawpt+WIDTH-1)+*(rawpt+WIDTH+1))/4;          /* R */
-                    *scanpt++ =  (*(rawpt-1)+*(rawpt+1)+*(rawpt-WIDTH)+*(rawpt+WIDTH))/4;      /* G */
-                    *scanpt++ =  *(rawpt); /* B */
-                } else
-                {
-                    /* bottom line or left column */
-
-                    *scanpt++ =  *(rawpt-WIDTH+1);          /* R */
-                    *scanpt++ =  (*(rawpt+1)+*(rawpt-WIDTH))/2;      /* G */
-                    *scanpt++ =  *(rawpt); /* B */
-                }
-            } else
-            { //odd pixel
-                if ( i < (WIDTH*(HEIGHT-1)) && ((i % WIDTH) < (WIDTH-1)) )
-                {
-                    *scanpt++ = (*(rawpt-WIDTH)+*(rawpt+WIDTH))/2;  /* R */
-                    *scanpt++ = *(rawpt);      /* G */
-                    *scanpt++ = (*(rawpt-1)+*(rawpt+1))/2; /* B */
-                } else
-                {
-                    /* bottom line or right column */
-
-                    *scanpt++ = (*(rawpt-WIDTH));  /* R */
-                    *scanpt++ = *(rawpt);      /* G */
-                    *scanpt++ = (*(rawpt-1)); /* B */
-                }
-            }
-        }
-        rawpt++;
-    }
-}
-
-static void
-rgb24_to_rgb24 (int width, int height, unsigned char *src, unsigned char *dst)
-{
-  const int size = width * height;
-  for(int i = 0; i < size; ++i, src += 3, dst += 3)
-  {
-    *(dst + 0) = *(src + 2);
-    *(dst + 1) = *(src + 1);
-    *(dst + 2) = *(src + 0);
-  }
-}
-
 #define CLAMP(x)        ((x)<0?0:((x)>255)?255:(x))
 
 typedef struct {
@@ -2101,7 +2467,7 @@ typedef struct {
 
 /* local storage */
 static code_table_t table[256];
-static int init_done = 0;
+static std::once_flag init_done;
 
 
 /*
@@ -2113,7 +2479,7 @@ static int init_done = 0;
   present at the MSB of byte x.
 
 */
-static void sonix_decompress_init(void)
+static void sonix_decompress_init_table(void)
 {
   int i;
   int is_abs, val, len;
@@ -2173,7 +2539,12 @@ static void sonix_decompress_init(void)
     table[i].len = len;
   }
 
-  init_done = 1;
+}
+
+/* Fills the shared table once, several captures may get here at the same time. */
+static void sonix_decompress_init(void)
+{
+  std::call_once(init_done, sonix_decompress_init_table);
 }
 
 
@@ -2199,11 +2570,6 @@ static int sonix_decompress(int width, int height, unsigned char *inp, unsigned
   unsigned char code;
   unsigned char *addr;
 
-  if (!init_done) {
-    /* do sonix_decompress_init first! */
-    return -1;
-  }
-
   bitpos = 0;
   for (row = 0; row < height; row++) {
 
@@ -2264,13 +2630,123 @@ static int sonix_decompress(int width, int height, unsigned char *inp, unsigned
 
 #include"util.h"
 
+/* Sets up the header of a retrieval buffer, and reallocates its data only if
+   it has to grow. */
+static void icvPrepareFrame(IplImage *frame, size_t *capacity, unsigned width, unsigned height, unsigned channels) {
+    if((unsigned)frame->width == width && (unsigned)frame->height == height &&
+       (unsigned)frame->nChannels == channels && frame->imageData)
+        return;
+    char *data = frame->imageData;
+    cvInitImageHeader( frame, cvSize(width, height), IPL_DEPTH_8U, channels, IPL_ORIGIN_TL, 4 );
+    if((size_t)frame->imageSize > *capacity) {
+        if(data)
+            cvFree(&data);
+        data = (char *)cvAlloc(frame->imageSize);
+        *capacity = frame->imageSize;
+    }
+    frame->imageData = data;
+}
+
+/* Describes the grabbed frame for the RetrieveProps kernels, false if they
+   don't handle the palette. */
+static bool v4l2_retrieve_source(CvCaptureCAM_V4L* capture, RetrieveSource &src) {
+#ifdef HAVE_CAMV4L2
+  switch (capture->palette) {
+  case PALETTE_YUYV:
+    src.layout = RL_YUYV;
+    break;
+  case PALETTE_GREY:
+    src.layout = RL_GREY;
+    break;
+  case PALETTE_NV12:
+    src.layout = RL_NV12;
+    break;
+  case PALETTE_YUV420:
+    src.layout = RL_YUV420;
+    break;
+  case PALETTE_YVU420:
+    src.layout = RL_YVU420;
+    break;
+  case PALETTE_UYVY:
+    src.layout = RL_UYVY;
+    break;
+  case PALETTE_BGR24:
+    src.layout = RL_BGR24;
+    break;
+  case PALETTE_RGB24:
+    src.layout = RL_RGB24;
+    break;
+  case PALETTE_SBGGR8:
+    src.layout = RL_SBGGR8;
+    break;
+  case PALETTE_SGBRG:
+    src.layout = RL_SGBRG8;
+    break;
+  default:
+    return false;
+  }
+  src.width = capture->form.fmt.pix.width;
+  src.height = capture->form.fmt.pix.height;
+  src.data = (unsigned char*)capture->buffers[capture->bufferIndex].start;
+  return true;
+#else
+  return false;
+#endif /* HAVE_CAMV4L2 */
+}
+
+/* Converts the grabbed frame for all props in one pass over the source buffer,
+   straight into the memory of the caller's matrices. These are allocated only
+   if their size or type differs. Returns false if this is not supported for
+   the current palette, so the caller can retrieve them one by one. */
+static bool icvRetrieveFramesCAM_V4L( CvCaptureCAM_V4L* capture, RetrieveProps *props, cv::Mat *images, int count) {
+#ifdef HAVE_CAMV4L2
+  RetrieveSource src;
+  bool mjpeg = false;
+#ifdef HAVE_JPEG
+  mjpeg = capture->palette == PALETTE_MJPEG;
+#endif
+  if (capture->v4l2Support == 0 || capture->deviceHandle == -1 || !(mjpeg || v4l2_retrieve_source(capture, src)) || count > MAX_RETRIEVE_TARGETS)
+    return false;
+
+  RetrieveTarget targets[MAX_RETRIEVE_TARGETS];
+  for (int i = 0; i < count; i++) {
+    if (!retrieve_resolve_target(capture->form.fmt.pix.width, capture->form.fmt.pix.height, props[i], targets[i])) {
+      fprintf( stderr, "VIDEOIO ERROR: V4L: Invalid scale or region in retrieval properties\n");
+      return false;
+    }
+    images[i].create(targets[i].rows, targets[i].cols, CV_8UC(targets[i].channels));
+    /* the kernels write the rows without gaps */
+    if (!images[i].isContinuous())
+      return false;
+    targets[i].dst = images[i].data;
+  }
+  if (!mjpeg) {
+    frame_to_targets(src, targets, count);
+    return true;
+  }
+#ifdef HAVE_JPEG
+  /* a joint pass would decode at full size, so each target gets its own scale */
+  for (int i = 0; i < count; i++) {
+    if (!mjpeg_to_target(capture, targets[i]))
+      return false;
+  }
+#endif
+  return true;
+#else
+  return false;
+#endif /* HAVE_CAMV4L2 */
+}
+
 static IplImage* icvRetrieveFrameCAM_V4L( CvCaptureCAM_V4L* capture, int notused, RetrieveProps &props) {
 #ifdef DEBUGOUTPUT
 	projector::Debug _debug("retrieve");
 #endif
 
+  if (capture->deviceHandle == -1)
+    return 0;
+
 #ifdef HAVE_CAMV4L2
-  if (V4L2_SUPPORT == 0)
+  if (capture->v4l2Support == 0)
 #endif /* HAVE_CAMV4L2 */
 #ifdef HAVE_CAMV4L
   {
@@ -2285,15 +2761,14 @@ static IplImage* icvRetrieveFrameCAM_V4L( CvCaptureCAM_V4L* capture, int notused
 	; // #ifdef vs if problem
    /* Now get what has already been captured as a IplImage return */
 
-   /* First, reallocate imageData if the frame size changed */
+   /* First, reallocate imageData if the frame has to grow */
 #if defined(HAVE_CAMV4L) || defined(HAVE_CAMV4L2)
 	unsigned effectiveWidth, effectiveHeight;
-	unsigned effectiveChannels = props.getChannels();
 #endif
 
 #ifdef HAVE_CAMV4L2
 
-  if (V4L2_SUPPORT == 1)
+  if (capture->v4l2Support == 1)
   {
 	effectiveWidth = capture->form.fmt.pix.width;
 	effectiveHeight = capture->form.fmt.pix.height;
@@ -2310,66 +2785,28 @@ static IplImage* icvRetrieveFrameCAM_V4L( CvCaptureCAM_V4L* capture, int notused
 #endif /* HAVE_CAMV4L */
 
 #if defined(HAVE_CAMV4L) || defined(HAVE_CAMV4L2)
-	cv::Rect region;
-	unsigned denominator = props.getDenominator();
-	if(denominator > 8) {
-		fprintf( stderr, "VIDEOIO ERROR: V4L: Invalid denominator in retrieval properties");
+	RetrieveTarget target;
+	if(!retrieve_resolve_target(effectiveWidth, effectiveHeight, props, target)) {
+		fprintf( stderr, "VIDEOIO ERROR: V4L: Invalid scale or region in retrieval properties\n");
 		return 0;
 	}
-	if(denominator > 1) { // we don't consider ROI if downsampling
-		effectiveWidth /= denominator;
-		effectiveHeight /= denominator;
-	}
-	else {
-		// make sure the region is valid
-		if(props.region.width > 0 && props.region.height > 0 && 
-			props.region.x >= 0 && props.region.y >= 0 &&
-			props.region.x + props.region.width <= effectiveWidth &&
-			props.region.y + props.region.height <= effectiveHeight) {
-			effectiveWidth = props.region.width;
-			effectiveHeight = props.region.height;
-			region = props.region;
-		}
-		else {		// otherwise we take the full image
-			region.x = 0; region.y = 0;
-			region.width = effectiveWidth;
-			region.height = effectiveHeight;
-		}
-	}
-
-    if(((unsigned long)capture->frame.width != effectiveWidth)
-       || ((unsigned long)capture->frame.height != effectiveHeight) ||
-		capture->frame.nChannels != effectiveChannels) {
-        cvFree(&capture->frame.imageData);
-        cvInitImageHeader( &capture->frame,
-              cvSize(effectiveWidth, effectiveHeight),
-              IPL_DEPTH_8U, effectiveChannels, IPL_ORIGIN_TL, 4 );
-       capture->frame.imageData = (char *)cvAlloc(capture->frame.imageSize);
-    }
-    else
+	icvPrepareFrame(&capture->frame, &capture->frameCapacity, target.cols, target.rows, target.channels);
 #endif /* HAVE_CAMV4L && HAVE_CAMV4L2 */
 
 DEB2("colsp", props.colorspace);
 
 #ifdef HAVE_CAMV4L2
 
-  if (V4L2_SUPPORT == 1)
+  RetrieveSource src;
+  if (capture->v4l2Support == 1 && v4l2_retrieve_source(capture, src))
+  {
+    target.dst = (unsigned char*)capture->frame.imageData;
+    frame_to_targets(src, &target, 1);
+  }
+  else if (capture->v4l2Support == 1)
   {
     switch (capture->palette)
     {
-    case PALETTE_BGR24:
-        memcpy((char *)capture->frame.imageData,
-               (char *)capture->buffers[capture->bufferIndex].start,
-               capture->frame.imageSize);
-        break;
-
-    case PALETTE_YVU420:
-        yuv420p_to_rgb24(capture->form.fmt.pix.width,
-                 capture->form.fmt.pix.height,
-                 (unsigned char*)(capture->buffers[capture->bufferIndex].start),
-                 (unsigned char*)capture->frame.imageData);
-        break;
-
     case PALETTE_YUV411P:
         yuv411p_to_rgb24(capture->form.fmt.pix.width,
                  capture->form.fmt.pix.height,
@@ -2378,60 +2815,32 @@ DEB2("colsp", props.colorspace);
         break;
 #ifdef HAVE_JPEG
     case PALETTE_MJPEG:
-        if (!mjpeg_to_rgb24(capture->form.fmt.pix.width,
-                    capture->form.fmt.pix.height,
-                    (unsigned char*)(capture->buffers[capture->bufferIndex]
-                             .start),
-                    capture->buffers[capture->bufferIndex].length,
-                    (unsigned char*)capture->frame.imageData))
+        target.dst = (unsigned char*)capture->frame.imageData;
+        if (!mjpeg_to_target(capture, target))
           return 0;
         break;
 #endif
 
-    case PALETTE_YUYV:
-        yuyv_to_propsDefined(capture->form.fmt.pix.width,
-                  capture->form.fmt.pix.height,
-                  (unsigned char*)(capture->buffers[capture->bufferIndex].start),
-                  (unsigned char*)capture->frame.imageData,
-					denominator, region, props.colorspace);
-        break;
-    case PALETTE_UYVY:
-        uyvy_to_rgb24(capture->form.fmt.pix.width,
-                  capture->form.fmt.pix.height,
-                  (unsigned char*)(capture->buffers[capture->bufferIndex].start),
-                  (unsigned char*)capture->frame.imageData);
-        break;
-    case PALETTE_SBGGR8:
-        bayer2rgb24(capture->form.fmt.pix.width,
-                capture->form.fmt.pix.height,
-                (unsigned char*)capture->buffers[capture->bufferIndex].start,
-                (unsigned char*)capture->frame.imageData);
-        break;
-
     case PALETTE_SN9C10X:
+    {
+        /* a leased frame leaves the spare buffer free for decompression */
+        int scratch = capture->bufferIndex != MAX_V4L_BUFFERS ?
+            MAX_V4L_BUFFERS : (capture->bufferIndex+1) % capture->req.count;
         sonix_decompress_init();
         sonix_decompress(capture->form.fmt.pix.width,
                  capture->form.fmt.pix.height,
                  (unsigned char*)capture->buffers[capture->bufferIndex].start,
-                 (unsigned char*)capture->buffers[(capture->bufferIndex+1) % capture->req.count].start);
+                 (unsigned char*)capture->buffers[scratch].start);
 
         bayer2rgb24(capture->form.fmt.pix.width,
                 capture->form.fmt.pix.height,
-                (unsigned char*)capture->buffers[(capture->bufferIndex+1) % capture->req.count].start,
+                (unsigned char*)capture->buffers[scratch].start,
                 (unsigned char*)capture->frame.imageData);
         break;
+    }
 
-    case PALETTE_SGBRG:
-        sgbrg2rgb24(capture->form.fmt.pix.width,
-                capture->form.fmt.pix.height,
-                (unsigned char*)capture->buffers[(capture->bufferIndex+1) % capture->req.count].start,
-                (unsigned char*)capture->frame.imageData);
-        break;
-    case PALETTE_RGB24:
-        rgb24_to_rgb24(capture->form.fmt.pix.width,
-                capture->form.fmt.pix.height,
-                (unsigned char*)capture->buffers[(capture->bufferIndex+1) % capture->req.count].start,
-                (unsigned char*)capture->frame.imageData);
+    default:
+        /* the rest are converted by frame_to_targets above */
         break;
     }
   }
@@ -2481,13 +2890,65 @@ DEB2("colsp", props.colorspace);
    return(&capture->frame);
 }
 
+static bool icvGetFrameInfoCAM_V4L (CvCaptureCAM_V4L* capture, FrameInfo &info) {
+#ifdef HAVE_CAMV4L2
+  if (capture->v4l2Support == 0 || !capture->sequenceValid)
+    return false;
+
+  info.timestampUs = capture->monotonic ?
+      (int64)capture->timestamp.tv_sec * 1000000 + capture->timestamp.tv_usec : 0;
+  info.sequence = capture->sequence;
+  info.dropped = capture->dropped;
+  return true;
+#else
+  return false;
+#endif /* HAVE_CAMV4L2 */
+}
+
+static bool icvStartRecordingCAM_V4L (CvCaptureCAM_V4L* capture, const char* filename, unsigned capacity) {
+#ifdef HAVE_CAMV4L2
+  v4l2_stop_recording(capture);
+  if (capture->v4l2Support == 0 || capture->deviceHandle == -1)
+    return false;
+
+  /* the replay backend understands YUYV only, the open may have chosen a
+     cheaper palette for the profile */
+  if (capture->palette != PALETTE_YUYV) {
+    int yuyv = 0;
+    while (palette_costs[yuyv].palette != PALETTE_YUYV)
+      yuyv++;
+    if (v4l2_change_palette(capture, yuyv) == -1) {
+      fprintf( stderr, "VIDEOIO ERROR: V4L2: the device does not give YUYV to record\n");
+      return false;
+    }
+  }
+
+  CvRawRecorder *recorder = new CvRawRecorder;
+  if (!recorder->open(filename, capture->form.fmt.pix.width, capture->form.fmt.pix.height, capacity)) {
+    fprintf( stderr, "VIDEOIO ERROR: V4L2: could not create recording %s\n", filename);
+    delete recorder;
+    return false;
+  }
+  capture->recorder = recorder;
+  return true;
+#else
+  return false;
+#endif /* HAVE_CAMV4L2 */
+}
+
+static void icvStopRecordingCAM_V4L (CvCaptureCAM_V4L* capture) {
+#ifdef HAVE_CAMV4L2
+  v4l2_stop_recording(capture);
+#endif /* HAVE_CAMV4L2 */
+}
+
 static double icvGetPropertyCAM_V4L (CvCaptureCAM_V4L* capture,
                                      int property_id ) {
 
 #ifdef HAVE_CAMV4L2
 
 #ifdef HAVE_CAMV4L
-  if (V4L2_SUPPORT == 1)
+  if (capture->v4l2Support == 1)
 #endif
   {
 
@@ -2508,6 +2969,20 @@ static double icvGetPropertyCAM_V4L (CvCaptureCAM_V4L* capture,
           return capture->form.fmt.pix.width;
       case CV_CAP_PROP_FRAME_HEIGHT:
           return capture->form.fmt.pix.height;
+      case CAP_PROP_MOD_LEASE:
+          return capture->leasing;
+      case CV_CAP_PROP_BUFFERSIZE:
+          return capture->req.count;
+      case CAP_PROP_MOD_DRAIN:
+          return capture->drainQueue;
+      case CAP_PROP_MOD_SEQUENCE:
+          return capture->sequence;
+      case CAP_PROP_MOD_DROPPED:
+          return capture->dropped;
+      case CV_CAP_PROP_FOURCC:
+          return capture->form.fmt.pix.pixelformat;
+      case CAP_PROP_MOD_PROFILE:
+          return capture->profile;
       }
 
       /* initialize the control structure */
@@ -2673,11 +3148,21 @@ static double icvGetPropertyCAM_V4L (CvCaptureCAM_V4L* capture,
 
 };
 
+/* True if the device already delivers w x h frames, so setting the size would
+   only repeat the slow S_FMT and S_PARM. */
+static bool icvVideoSizeIs( CvCaptureCAM_V4L* capture, int w, int h) {
+#ifdef HAVE_CAMV4L2
+  if (capture->v4l2Support == 1)
+    return capture->form.fmt.pix.width == (unsigned)w && capture->form.fmt.pix.height == (unsigned)h;
+#endif /* HAVE_CAMV4L2 */
+  return false;
+}
+
 static int icvSetVideoSize( CvCaptureCAM_V4L* capture, int w, int h) {
 
 #ifdef HAVE_CAMV4L2
 
-  if (V4L2_SUPPORT == 1)
+  if (capture->v4l2Support == 1)
   {
 
     CLEAR (capture->cropcap);
@@ -2740,6 +3225,18 @@ static int icvSetVideoSize( CvCaptureCAM_V4L* capture, int w, int h) {
       return 0;
     }
 
+    /* the driver may pad the rows in the new size, choose a palette it doesn't */
+    if (!v4l2_format_packed(capture->form) &&
+        autosetup_capture_mode_v4l2(capture, capture->form.fmt.pix.width, capture->form.fmt.pix.height) == -1)
+    {
+      icvCloseCAM_V4L(capture);
+
+      return 0;
+    }
+
+    /* the next open starts with this size */
+    v4l2_cache_store(capture);
+
     return 0;
 
   }
@@ -2792,7 +3289,7 @@ static int icvSetControl (CvCaptureCAM_V4L* capture,
 
 #ifdef HAVE_CAMV4L2
 
-  if (V4L2_SUPPORT == 1)
+  if (capture->v4l2Support == 1)
   {
 
     /* default value for min and max */
@@ -2965,7 +3462,6 @@ static int icvSetControl (CvCaptureCAM_V4L* capture,
 
 static int icvSetPropertyCAM_V4L( CvCaptureCAM_V4L* capture,
                                   int property_id, double value ){
-    static int width = 0, height = 0;
     int retval;
 
     /* initialization */
@@ -2977,17 +3473,19 @@ static int icvSetPropertyCAM_V4L( CvCaptureCAM_V4L* capture,
 
     switch (property_id) {
     case CV_CAP_PROP_FRAME_WIDTH:
-        width = cvRound(value);
-        if(width !=0 && height != 0) {
-            retval = icvSetVideoSize( capture, width, height);
-            width = height = 0;
+        capture->pendingWidth = cvRound(value);
+        if(capture->pendingWidth !=0 && capture->pendingHeight != 0) {
+            if(!icvVideoSizeIs( capture, capture->pendingWidth, capture->pendingHeight))
+                retval = icvSetVideoSize( capture, capture->pendingWidth, capture->pendingHeight);
+            capture->pendingWidth = capture->pendingHeight = 0;
         }
         break;
     case CV_CAP_PROP_FRAME_HEIGHT:
-        height = cvRound(value);
-        if(width !=0 && height != 0) {
-            retval = icvSetVideoSize( capture, width, height);
-            width = height = 0;
+        capture->pendingHeight = cvRound(value);
+        if(capture->pendingWidth !=0 && capture->pendingHeight != 0) {
+            if(!icvVideoSizeIs( capture, capture->pendingWidth, capture->pendingHeight))
+                retval = icvSetVideoSize( capture, capture->pendingWidth, capture->pendingHeight);
+            capture->pendingWidth = capture->pendingHeight = 0;
         }
         break;
     case CV_CAP_PROP_BRIGHTNESS:
@@ -2998,6 +3496,23 @@ static int icvSetPropertyCAM_V4L( CvCaptureCAM_V4L* capture,
     case CV_CAP_PROP_EXPOSURE:
         retval = icvSetControl(capture, property_id, value);
         break;
+#ifdef HAVE_CAMV4L2
+    case CAP_PROP_MOD_LEASE:
+        /* takes effect from the next grab, a lease held now is dropped then */
+        capture->leasing = value != 0.0;
+        break;
+    case CV_CAP_PROP_BUFFERSIZE:
+        if (capture->v4l2Support == 1)
+            retval = v4l2_set_buffer_count(capture, cvRound(value));
+        break;
+    case CAP_PROP_MOD_DRAIN:
+        capture->drainQueue = value != 0.0;
+        break;
+    case CAP_PROP_MOD_PROFILE:
+        if (capture->v4l2Support == 1)
+            retval = v4l2_set_profile(capture, cvRound(value));
+        break;
+#endif /* HAVE_CAMV4L2 */
     default:
         fprintf(stderr,
                 "VIDEOIO ERROR: V4L: setting property #%d is not supported\n",
@@ -3015,15 +3530,17 @@ static void icvCloseCAM_V4L( CvCaptureCAM_V4L* capture ){
    {
 
 #ifdef HAVE_CAMV4L2
-     if (V4L2_SUPPORT == 0)
+     if (capture->v4l2Support == 0)
 #endif /* HAVE_CAMV4L2 */
 #ifdef HAVE_CAMV4L
      {
 
        if (capture->mmaps)
          free(capture->mmaps);
+       capture->mmaps = 0;
        if (capture->memoryMap)
          munmap(capture->memoryMap, capture->memoryBuffer.size);
+       capture->memoryMap = 0;
 
      }
 #endif /* HAVE_CAMV4L */
@@ -3032,28 +3549,15 @@ static void icvCloseCAM_V4L( CvCaptureCAM_V4L* capture ){
 #endif /* HAVE_CAMV4L && HAVE_CAMV4L2 */
 #ifdef HAVE_CAMV4L2
        {
-       capture->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-       if (-1 == ioctl(capture->deviceHandle, VIDIOC_STREAMOFF, &capture->type)) {
-           perror ("Unable to stop the stream.");
-       }
-
-       for (unsigned int n_buffers_ = 0; n_buffers_ < capture->req.count; ++n_buffers_)
-       {
-           if (-1 == munmap (capture->buffers[n_buffers_].start, capture->buffers[n_buffers_].length)) {
-               perror ("munmap");
-           }
-       }
-
-       if (capture->buffers[MAX_V4L_BUFFERS].start)
-       {
-           free(capture->buffers[MAX_V4L_BUFFERS].start);
-           capture->buffers[MAX_V4L_BUFFERS].start = 0;
-       }
+       icvStopRecordingCAM_V4L(capture);
+       v4l2_release_buffers(capture);
      }
 #endif /* HAVE_CAMV4L2 */
 
      if (capture->deviceHandle != -1)
        close(capture->deviceHandle);
+     /* a closed capture fails the grabs, and closing again does nothing */
+     capture->deviceHandle = -1;
 
      if (capture->frame.imageData) cvFree(&capture->frame.imageData);
       //cvFree((void **)capture);
@@ -3074,6 +3578,10 @@ public:
     virtual bool setProperty(int, double);
     virtual bool grabFrame();
     virtual IplImage* retrieveFrame(int, RetrieveProps &props);
+    virtual bool retrieveFrames(int, RetrieveProps *props, cv::Mat *images, int count);
+    virtual bool getFrameInfo(FrameInfo &info);
+    virtual bool startRecording(const char* filename, unsigned capacity);
+    virtual void stopRecording();
 protected:
 
     CvCaptureCAM_V4L* captureV4L;
@@ -3105,6 +3613,27 @@ IplImage* CvCaptureCAM_V4L_CPP::retrieveFrame(int, RetrieveProps &props)
     return captureV4L ? icvRetrieveFrameCAM_V4L( captureV4L, 0, props ) : 0;
 }
 
+bool CvCaptureCAM_V4L_CPP::retrieveFrames(int, RetrieveProps *props, cv::Mat *images, int count)
+{
+    return captureV4L ? icvRetrieveFramesCAM_V4L( captureV4L, props, images, count ) : false;
+}
+
+bool CvCaptureCAM_V4L_CPP::getFrameInfo(FrameInfo &info)
+{
+    return captureV4L ? icvGetFrameInfoCAM_V4L( captureV4L, info ) : false;
+}
+
+bool CvCaptureCAM_V4L_CPP::startRecording(const char* filename, unsigned capacity)
+{
+    return captureV4L ? icvStartRecordingCAM_V4L( captureV4L, filename, capacity ) : false;
+}
+
+void CvCaptureCAM_V4L_CPP::stopRecording()
+{
+    if( captureV4L )
+        icvStopRecordingCAM_V4L( captureV4L );
+}
+
 double CvCaptureCAM_V4L_CPP::getProperty( int propId )
 {
     return captureV4L ? icvGetPropertyCAM_V4L( captureV4L, propId ) : 0.0;
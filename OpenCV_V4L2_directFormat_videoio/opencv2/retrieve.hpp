@@ -16,18 +16,124 @@ enum RetrDownsample { DS_ORIGINAL, DS_HALF, DS_QUARTER, DS_OCT };
 
 /**
 Color format possibilities. CS_BGR is not implemented, CS_YCRCB is used instead.
+The planar formats come in a single channel image: the Y plane followed by the
+U and V planes of half width and full (4:2:2) or half (4:2:0) height. Their
+width, and for 4:2:0 their height, is rounded down to even.
 */
-enum RetrColorspace { CS_GRAY, CS_YCRCB, CS_BGR };
+enum RetrColorspace { CS_GRAY, CS_YCRCB, CS_BGR, CS_YCRCB_422P, CS_YCRCB_420P };
+
+/**
+Orientation of the output, applied while converting. The rotations are
+clockwise and swap the output width and height, they are not available for
+CS_YCRCB_422P.
+*/
+enum RetrOrientation { OR_NONE, OR_FLIP_HORIZONTAL, OR_FLIP_VERTICAL, OR_ROTATE_90, OR_ROTATE_180, OR_ROTATE_270 };
+
+/**
+Number of fraction bits of the remap table coordinates.
+*/
+#define RETRIEVE_REMAP_BITS 5
+
+/**
+Precomputed fixed point remap table, like a lens undistortion map. The output
+pixel (x, y) is sampled bilinearly at the full frame position stored at
+xy[2 * (y * width + x)] and the next element, in units of
+1 / (1 << RETRIEVE_REMAP_BITS) pixels. Positions outside the frame repeat the
+border pixels.
+*/
+typedef struct RetrieveRemap {
+	/** Size of the output before orientation.
+	*/
+	int width, height;
+
+	/** Source positions, x and y interleaved, width * height pairs.
+	*/
+	std::vector<int> xy;
+} RetrieveRemap;
+
+/**
+Fills remap from the floating point maps of cv::remap, for example from
+cv::initUndistortRectifyMap with CV_32FC1. Returns false if the maps are not
+CV_32FC1 ones of the same size.
+*/
+bool createRetrieveRemap(const cv::Mat &mapX, const cv::Mat &mapY, RetrieveRemap &remap);
+
+/**
+Additional property identifiers for VideoCapture_mod::set and get. They are
+placed well above the OpenCV ones to avoid collisions.
+*/
+enum RetrProperty {
+	/** If nonzero, grabbed V4L2 frames are leased direct from the mmap buffers
+	instead of being copied into a spare buffer. */
+	CAP_PROP_MOD_LEASE = 1000,
+
+	/** If nonzero, grab dequeues all the ready V4L2 buffers, keeps the newest
+	and requeues the others at once. Otherwise frames are taken in FIFO order. */
+	CAP_PROP_MOD_DRAIN,
+
+	/** Read only, sequence number of the last grabbed frame assigned by the driver. */
+	CAP_PROP_MOD_SEQUENCE,
+
+	/** Read only, number of frames missing from the sequence since streaming began. */
+	CAP_PROP_MOD_DROPPED,
+
+	/** For raw recordings, if nonzero, grab waits to replay at the recorded
+	pace, otherwise frames are read as fast as possible. */
+	CAP_PROP_MOD_REPLAY_PACED,
+
+	/** For image sequences, number of frames decoded ahead on worker threads,
+	0 to load each frame synchronously in grab. */
+	CAP_PROP_MOD_PREFETCH,
+
+	/** For V4L2, bit set of 1 << RetrColorspace values mostly retrieved.
+	Setting it switches to the pixel format cheapest to convert into these,
+	read CV_CAP_PROP_FOURCC to see the chosen one. */
+	CAP_PROP_MOD_PROFILE,
+
+	/** Number of threads converting large frames in horizontal bands, the
+	retrieving one included, from 1 to 16. The workers are shared by all the
+	captures, a retrieval finding them busy converts on its own thread. */
+	CAP_PROP_MOD_CONVERT_THREADS,
+
+	/** Frames with fewer pixels than this are converted on the retrieving
+	thread only, as waking the workers would cost more than it saves. */
+	CAP_PROP_MOD_CONVERT_MIN_PIXELS
+};
+
+/**
+Driver-side information about the last grabbed frame.
+*/
+typedef struct FrameInfo {
+	/** Time of capture in microseconds of CLOCK_MONOTONIC as stamped by the
+	driver, 0 if the driver uses an other clock.
+	*/
+	int64 timestampUs;
+
+	/** Frame sequence number assigned by the driver.
+	*/
+	unsigned sequence;
+
+	/** Number of frames missing from the sequence since streaming began, either
+	dropped by the driver or skipped in drain mode.
+	*/
+	unsigned long dropped;
+} FrameInfo;
 
 /**
 Struct describing the retrieval options.
 */
 typedef struct RetrieveProps {
-	/** Downsampling of the full frame.
+	/** Downsampling of the region.
 	*/
     RetrDownsample sampling;
 
-	/** Region of interest in the frame, considered only when sampling is DS_ORIGINAL.
+	/** Integer downsampling factor from 1 to 16, overrides sampling if nonzero.
+	*/
+    unsigned scale = 0;
+
+	/** Region of interest in the frame, the whole frame is taken if it is invalid.
+	The output is the region downsampled, with the partial blocks at the right
+	and bottom dropped.
 	*/
     cv::Rect_<unsigned> region;
 
@@ -35,18 +141,49 @@ typedef struct RetrieveProps {
 	*/	
     RetrColorspace colorspace;
 
+	/** Orientation of the output.
+	*/
+    RetrOrientation orientation = OR_NONE;
+
+	/** Remap table applied before the orientation, NULL if none. If given, it
+	defines the output size alone, the sampling and the region are ignored, and
+	planar color formats are not available. It must outlive the retrievals.
+	*/
+    const RetrieveRemap *remap = NULL;
+
 	/**
 	Returns the downsampling denominator for calculations.
 	*/
-	int getDenominator() {
-		return 1 << sampling;
+	int getDenominator() const {
+		return scale != 0 ? scale : 1 << sampling;
+	}
+
+	/**
+	Returns true for the planar color formats.
+	*/
+	bool isPlanar() const {
+		return colorspace == CS_YCRCB_422P || colorspace == CS_YCRCB_420P;
 	}
 
 	/**
 	Returns the number of channels for the color format.
 	*/
-	int getChannels() {
-		return colorspace == CS_GRAY ? 1 : 3;
+	int getChannels() const {
+		return colorspace == CS_GRAY || isPlanar() ? 1 : 3;
+	}
+
+	/**
+	Returns true if the orientation swaps the output width and height.
+	*/
+	bool isTurned() const {
+		return orientation == OR_ROTATE_90 || orientation == OR_ROTATE_270;
+	}
+
+	/**
+	Returns the number of image rows holding an output of the given height.
+	*/
+	int getRows(int height) const {
+		return colorspace == CS_YCRCB_422P ? height * 2 : colorspace == CS_YCRCB_420P ? height * 3 / 2 : height;
 	}
 } RetrieveProps;
 
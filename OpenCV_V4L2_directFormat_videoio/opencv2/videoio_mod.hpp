@@ -49,6 +49,7 @@ VideoCapture retrieve changes copyleft Balázs Bámer, 2015.
 #ifndef __OPENCV_VIDEOIO_MOD_HPP__
 #define __OPENCV_VIDEOIO_MOD_HPP__
 
+#include <vector>
 #include <opencv2/core.hpp>
 #include "opencv2/retrieve.hpp"
 
@@ -84,9 +85,21 @@ public:
     CV_WRAP virtual bool grab();
 
 	/**
-	Retrieves the frame using the currently set RetrieveProps properties.
+	Retrieves the frame using the currently set RetrieveProps properties. If
+	image is a Mat and the backend supports it, the frame is converted straight
+	into its memory, which is reallocated only if the size or type differs.
 	*/
     CV_WRAP virtual bool retrieve(OutputArray image, int flag = 0);
+
+	/**
+	Retrieves the same grabbed frame once for each element of props. The
+	backend may convert all of them in a single pass over the raw frame, which
+	is much cheaper than subsequent retrieve calls. The conversion writes
+	straight into the elements of images, as the single-image version does.
+	The currently set RetrieveProps remain untouched. images is resized to
+	the size of props.
+	*/
+    virtual bool retrieve(std::vector<RetrieveProps> &props, std::vector<Mat> &images);
     virtual VideoCapture_mod& operator >> (CV_OUT Mat& image);
     virtual VideoCapture_mod& operator >> (CV_OUT UMat& image);
 
@@ -99,6 +112,25 @@ public:
     CV_WRAP virtual double get(int propId);
 	void set(RetrieveProps &props);
 
+	/**
+	Fills info with the driver timestamp, sequence number and dropped frame
+	count of the last grabbed frame. Returns false if the backend can't tell.
+	*/
+	bool getFrameInfo(FrameInfo &info);
+
+	/**
+	Starts recording the raw grabbed frames into filename, which is used as a
+	ring of capacity frames and can be replayed later by open. The file is
+	preallocated, and a running recording is stopped first. Returns false if
+	the backend or the current pixel format does not support recording.
+	*/
+	bool startRecording(const String& filename, int capacity);
+
+	/**
+	Stops recording, the file keeps the frames written so far.
+	*/
+	void stopRecording();
+
 protected:
     Ptr<CvCapture> cap;
     Ptr<IVideoCapture> icap;
@@ -55,10 +55,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <limits.h>
 #include <ctype.h>
 #include <assert.h>
 
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 #define __BEGIN__ __CV_BEGIN__
 #define __END__  __CV_END__
 #define EXIT __CV_EXIT__
@@ -72,6 +78,13 @@ struct CvCapture
     virtual bool setProperty(int, double) { return 0; }
     virtual bool grabFrame() { return true; }
     virtual IplImage* retrieveFrame(int, RetrieveProps &props) { return 0; }
+    // Retrieves the grabbed frame for several properties at once direct into images, false if not supported
+    virtual bool retrieveFrames(int, RetrieveProps *, cv::Mat *, int) { return false; }
+    // Fills info for the last grabbed frame, false if not supported
+    virtual bool getFrameInfo(FrameInfo &) { return false; }
+    // Starts appending the raw grabbed frames to a ring file of capacity frames, false if not supported
+    virtual bool startRecording(const char*, unsigned) { return false; }
+    virtual void stopRecording() {}
     virtual int getCaptureDomain() { return CV_CAP_ANY; } // Return the type of the capture object: CV_CAP_VFW, etc...
 };
 
@@ -83,7 +96,153 @@ struct CvVideoWriter
     virtual bool writeFrame(const IplImage*) { return false; }
 };
 
+/*************************** Conversion kernels *********************************/
+
+// Maximal number of outputs filled by a single retrieval
+#define MAX_RETRIEVE_TARGETS 4
+
+// Maximal number of threads converting a frame in parallel
+#define MAX_CONVERT_THREADS 16
+
+// One output of a retrieval with its properties resolved against the frame size
+struct RetrieveTarget
+{
+    RetrColorspace colorspace;
+    unsigned channels;
+    unsigned denominator;
+    cv::Rect region;        // source region
+    int width, height;      // output size before orientation
+    int cols, rows;         // output image size, the planes of planar outputs add to the rows
+    RetrOrientation orientation;
+    const RetrieveRemap *remap;     // NULL if none
+    unsigned char *dst;     // continuous output buffer
+};
+
+// Fills target according to props and the frame size, false if props are invalid
+bool retrieve_resolve_target(unsigned width, unsigned height, const RetrieveProps &props, RetrieveTarget &target);
+
+void yuyv_to_propsDefined(int width, int height, unsigned char *src, unsigned char *dst, unsigned denominator, cv::Rect &region, RetrColorspace colorspace);
+
+// Converts the source rows [first, last) of the YUYV frame for all targets in
+// a single pass, first is a multiple of 8
+void yuyv_to_targets(int width, int height, unsigned char *src, RetrieveTarget *targets, int count, int first, int last);
+
+// Layouts of captured frames the retrieval converts from
+enum RetrieveLayout
+{
+    RL_YUYV,        // packed 4:2:2, Y U Y V
+    RL_GREY,        // luma only
+    RL_NV12,        // 4:2:0, luma plane followed by interleaved U V plane
+    RL_YUV420,      // 4:2:0, luma, U and V planes
+    RL_YVU420,      // 4:2:0, luma, V and U planes
+    RL_UYVY,        // packed 4:2:2, U Y V Y
+    RL_BGR24,       // packed B G R
+    RL_RGB24,       // packed R G B
+    RL_SBGGR8,      // Bayer, B G / G R cells
+    RL_SGBRG8,      // Bayer, G B / R G cells
+    RL_YUV24        // packed Y U V, as decoded from JPEG
+};
+
+// A captured frame to convert
+struct RetrieveSource
+{
+    RetrieveLayout layout;
+    int width, height;
+    unsigned char *data;
+};
+
+// Converts the frame for all targets in a single pass over the source, whatever its layout
+void frame_to_targets(const RetrieveSource &src, RetrieveTarget *targets, int count);
+
+// Frames of at least minPixels pixels are converted in row bands by threads
+// threads, the calling one included, 1 converts on the calling thread only
+void retrieve_set_parallel(int threads, int minPixels);
+void retrieve_get_parallel(int &threads, int &minPixels);
+
+// Compares every vector kernel set the CPU supports with the scalar reference
+// over odd widths and regions, reports each set to stderr and returns the
+// number of sets differing
+int retrieve_check_kernels();
+
+/*************************** Raw YUYV recordings ********************************/
+
+// The file starts with a RawFileHeader, followed by capacity RawFrameEntry
+// items, then capacity frame slots of frameSize bytes from dataOffset. Frame
+// number n lives in slot n % capacity, so a recording may wrap around.
+#define RAW_FILE_MAGIC "YUYVRAW1"
+// 'Y' | 'U' << 8 | 'Y' << 16 | 'V' << 24, the same as V4L2_PIX_FMT_YUYV
+#define RAW_PIXEL_FORMAT_YUYV 0x56595559u
+// Largest recording mapped at once, leaving room in a 32-bit address space
+#define RAW_MAX_MAPPING (sizeof(size_t) < 8 ? (uint64_t)1 << 30 : (uint64_t)1 << 40)
+
+struct RawFileHeader
+{
+    char magic[8];
+    uint32_t width, height;
+    uint32_t frameSize;     // width * height * 2
+    uint32_t capacity;      // number of slots
+    uint32_t pixelFormat;   // fourcc of the frames
+    uint32_t reserved;
+    uint64_t frameCount;    // frames written so far, may exceed capacity
+    uint64_t dataOffset;    // offset of the first slot, page aligned
+};
+
+struct RawFrameEntry
+{
+    int64_t timestampUs;    // CLOCK_MONOTONIC, 0 if unknown
+    uint32_t sequence;
+    uint32_t dropped;
+};
+
+// Appends frames to a preallocated, memory-mapped ring file. A writer thread
+// copies each posted frame into the page cache, the kernel writes it back in
+// the background, so the grabbing thread never waits for the disk. A wrapped
+// file keeps the last capacity frames.
+class CvRawRecorder
+{
+public:
+    CvRawRecorder();
+    ~CvRawRecorder() { close(); }
+
+    bool open(const char* filename, unsigned width, unsigned height, unsigned capacity);
+    // Writes the frame still posted, then stops the writer thread and unmaps the file
+    void close();
+    // Bytes a posted frame must have, width * height * 2
+    size_t frameSize() const { return header ? header->frameSize : 0; }
+    // Hands a frame of frameSize() bytes to the writer thread, false if it is
+    // still busy with the previous one. Unless copy is set, the frame has to
+    // stay valid until busy() returns false.
+    bool post(const void* frame, const RawFrameEntry &entry, bool copy);
+    // True while the writer thread still reads the last posted frame
+    bool busy();
+    // Waits until the last posted frame is written
+    void flush();
+
+protected:
+    void append(const void* frame, const RawFrameEntry &entry);
+    void writeLoop();
+
+    int fd;
+    unsigned char* data;
+    size_t dataLength;
+    RawFileHeader* header;
+    RawFrameEntry* index;
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable posted;
+    std::condition_variable written;
+    const void* pending;
+    RawFrameEntry pendingEntry;
+    bool stopping;
+    // posted frames are copied here if they can not stay valid
+    std::vector<unsigned char> copied;
+};
+
+/********************************************************************************/
+
 CvCapture * cvCreateCameraCapture_V4L( int index );
+CvCapture* cvCreateFileCapture_Raw(const char* filename);
 CvCapture* cvCreateFileCapture_Images(const char* filename);
 CvVideoWriter* cvCreateVideoWriter_Images(const char* filename);
 
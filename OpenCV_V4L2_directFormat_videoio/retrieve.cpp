@@ -0,0 +1,1683 @@
+/** @file
+Conversion kernels from the captured YUYV, UYVY, gray, 4:2:0, RGB and Bayer
+buffers to the formats described by RetrieveProps. They are shared by the capture backends.
+
+Copyleft Balázs Bámer, 2015.
+*/
+
+#include "precomp.hpp"
+#include "opencv2/retrieve.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include"still_config.h"
+
+#if USE_NVWA == 1
+#include"debug_new.h"
+#endif
+
+/* The scalar kernels are templates specialised at compile time for the
+   sample order of the palette, the colorspace and the downsampling exponent,
+   so there are no runtime switches in them and the block loops unroll
+   completely. The instantiations are picked from constexpr tables. */
+
+// Sample orders of the packed 4:2:2 palettes.
+struct YuyvOrder {
+	enum { y0 = 0, u = 1, y1 = 2, v = 3 };
+};
+
+struct UyvyOrder {
+	enum { y0 = 1, u = 0, y1 = 3, v = 2 };
+};
+
+// Each pixel gets the chroma of its own pair, in Y, U, V order.
+template<class Order, RetrColorspace CS>
+static void packedRegion(int width, const unsigned char *src, unsigned char *dst, const cv::Rect &region) {
+	int lineLen = width << 1;
+	for(int i = region.y; i < region.y + region.height; i++) {
+		const unsigned char *s = src + lineLen * i;
+		for(int x = region.x; x < region.x + region.width; x++) {
+			const unsigned char *pair = s + ((x >> 1) << 2);
+			*dst++ = pair[x & 1 ? Order::y1 : Order::y0];
+			if(CS != CS_GRAY) {
+				*dst++ = pair[Order::u];
+				*dst++ = pair[Order::v];
+			}
+		}
+	}
+}
+
+// Averages blocks of 2**EXP x 2**EXP pixels, luma over all of them, chroma
+// over the pairs.
+template<class Order, RetrColorspace CS, int EXP>
+static void packedDown(int width, int height, const unsigned char *src, unsigned char *dst) {
+	const int denom = 1 << EXP;
+	const unsigned sh = EXP << 1;
+	int dw = width >> EXP;
+	int dh = height >> EXP;
+	int lineLen = width << 1;
+	for(int i = 0; i < dh; i++) {
+		const unsigned char *row = src + lineLen * denom * i;
+		for(int j = 0; j < dw; j++) {
+			const unsigned char *s = row + (denom << 1) * j;
+			unsigned sumY = 0, sumU = 0, sumV = 0;
+			for(int k = 0; k < denom; k++) {
+				for(int l = 0; l < denom << 1; l += 4) {
+					sumY += s[l + Order::y0] + s[l + Order::y1];
+					if(CS != CS_GRAY) {
+						sumU += s[l + Order::u];
+						sumV += s[l + Order::v];
+					}
+				}
+				s += lineLen;
+			}
+			*dst++ = sumY >> sh;
+			if(CS != CS_GRAY) {
+				*dst++ = sumU >> (sh - 1);
+				*dst++ = sumV >> (sh - 1);
+			}
+		}
+	}
+}
+
+static int logTwo(unsigned n) {
+	int sh = 0;
+	while(n > 1) {
+		n >>= 1;
+		sh++;
+	}
+	return sh;
+}
+
+// Index of the colorspace in the kernel tables, CS_BGR is converted as CS_YCRCB.
+static constexpr int colorIndex(RetrColorspace colorspace) {
+	return colorspace == CS_GRAY ? 0 : 1;
+}
+
+typedef void (*PackedRegionKernel)(int width, const unsigned char *src, unsigned char *dst, const cv::Rect &region);
+typedef void (*PackedDownKernel)(int width, int height, const unsigned char *src, unsigned char *dst);
+
+// Kernels by palette (YUYV, UYVY) and colorspace index.
+static constexpr PackedRegionKernel packedRegionKernels[2][2] = {
+	{ packedRegion<YuyvOrder, CS_GRAY>, packedRegion<YuyvOrder, CS_YCRCB> },
+	{ packedRegion<UyvyOrder, CS_GRAY>, packedRegion<UyvyOrder, CS_YCRCB> }
+};
+
+// Kernels by palette, colorspace index and downsampling exponent - 1.
+static constexpr PackedDownKernel packedDownKernels[2][2][DS_OCT] = {
+	{ { packedDown<YuyvOrder, CS_GRAY, 1>, packedDown<YuyvOrder, CS_GRAY, 2>, packedDown<YuyvOrder, CS_GRAY, 3> },
+	  { packedDown<YuyvOrder, CS_YCRCB, 1>, packedDown<YuyvOrder, CS_YCRCB, 2>, packedDown<YuyvOrder, CS_YCRCB, 3> } },
+	{ { packedDown<UyvyOrder, CS_GRAY, 1>, packedDown<UyvyOrder, CS_GRAY, 2>, packedDown<UyvyOrder, CS_GRAY, 3> },
+	  { packedDown<UyvyOrder, CS_YCRCB, 1>, packedDown<UyvyOrder, CS_YCRCB, 2>, packedDown<UyvyOrder, CS_YCRCB, 3> } }
+};
+
+/********************************************************************************/
+/* Vectorized kernels. The scalar ones above remain the reference: the vector
+   versions are built from row primitives selected by CPU features at first use,
+   and must produce the very same bytes, which is verified before selection. */
+
+#if USE_SIMD == 1 && defined(__GNUC__) && defined(__SSE2__)
+#define RETRIEVE_SIMD_X86
+#include <immintrin.h>
+#elif USE_SIMD == 1 && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define RETRIEVE_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// Copies n luma bytes from a YUYV row starting at a Y byte.
+typedef void (*GrayRowKernel)(const unsigned char *s, unsigned char *d, int n);
+// Converts n complete YUYV pairs to 2n YUV pixels.
+typedef void (*YcrcbRowKernel)(const unsigned char *s, unsigned char *d, int n);
+// Adds n bytes to n 16-bit accumulators.
+typedef void (*AccumulateRowKernel)(const unsigned char *s, unsigned short *acc, int n);
+
+struct RowKernels {
+	const char *name;
+	GrayRowKernel gray;
+	YcrcbRowKernel ycrcb;
+	AccumulateRowKernel accumulate;
+};
+
+static void grayRowScalar(const unsigned char *s, unsigned char *d, int n) {
+	for(int i = 0; i < n; i++) {
+		d[i] = s[i << 1];
+	}
+}
+
+static void ycrcbRowScalar(const unsigned char *s, unsigned char *d, int n) {
+	for(int i = 0; i < n; i++) {
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = s[3];
+		d[3] = s[2];
+		d[4] = s[1];
+		d[5] = s[3];
+		s += 4;
+		d += 6;
+	}
+}
+
+static void accumulateRowScalar(const unsigned char *s, unsigned short *acc, int n) {
+	for(int i = 0; i < n; i++) {
+		acc[i] += s[i];
+	}
+}
+
+#ifdef RETRIEVE_SIMD_X86
+static void grayRowSse2(const unsigned char *s, unsigned char *d, int n) {
+	const __m128i mask = _mm_set1_epi16(0xff);
+	int i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(s + (i << 1))), mask);
+		__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(s + (i << 1) + 16)), mask);
+		_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(a, b));
+	}
+	grayRowScalar(s + (i << 1), d + i, n - i);
+}
+
+static void accumulateRowSse2(const unsigned char *s, unsigned short *acc, int n) {
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+		__m128i *a = (__m128i*)(acc + i);
+		_mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_unpackhi_epi8(v, zero)));
+	}
+	accumulateRowScalar(s + i, acc + i, n - i);
+}
+
+// 4 pairs make 24 output bytes, a byte shuffle yields the first 16 and the last 8 of them.
+__attribute__((target("ssse3")))
+static void ycrcbRowSsse3(const unsigned char *s, unsigned char *d, int n) {
+	const __m128i first = _mm_setr_epi8(0, 1, 3, 2, 1, 3, 4, 5, 7, 6, 5, 7, 8, 9, 11, 10);
+	const __m128i last = _mm_setr_epi8(9, 11, 12, 13, 15, 14, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(s + (i << 2)));
+		_mm_storeu_si128((__m128i*)(d + i * 6), _mm_shuffle_epi8(v, first));
+		_mm_storel_epi64((__m128i*)(d + i * 6 + 16), _mm_shuffle_epi8(v, last));
+	}
+	ycrcbRowScalar(s + (i << 2), d + i * 6, n - i);
+}
+
+__attribute__((target("avx2")))
+static void grayRowAvx2(const unsigned char *s, unsigned char *d, int n) {
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	int i = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(s + (i << 1))), mask);
+		__m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(s + (i << 1) + 32)), mask);
+		// packing works within 128-bit lanes, restore the order
+		_mm256_storeu_si256((__m256i*)(d + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+	}
+	grayRowSse2(s + (i << 1), d + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulateRowAvx2(const unsigned char *s, unsigned short *acc, int n) {
+	int i = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i *a = (__m256i*)(acc + i);
+		__m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + i)));
+		__m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + i + 16)));
+		_mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), lo));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi16(_mm256_loadu_si256(a + 1), hi));
+	}
+	accumulateRowSse2(s + i, acc + i, n - i);
+}
+
+static const RowKernels kernelsSse2 = { "SSE2", grayRowSse2, ycrcbRowScalar, accumulateRowSse2 };
+static const RowKernels kernelsSsse3 = { "SSSE3", grayRowSse2, ycrcbRowSsse3, accumulateRowSse2 };
+static const RowKernels kernelsAvx2 = { "AVX2", grayRowAvx2, ycrcbRowSsse3, accumulateRowAvx2 };
+#endif /* RETRIEVE_SIMD_X86 */
+
+#ifdef RETRIEVE_SIMD_NEON
+static void grayRowNeon(const unsigned char *s, unsigned char *d, int n) {
+	int i = 0;
+	for(; i + 16 <= n; i += 16) {
+		vst1q_u8(d + i, vld2q_u8(s + (i << 1)).val[0]);
+	}
+	grayRowScalar(s + (i << 1), d + i, n - i);
+}
+
+// 16 pairs are split into Y0, U, Y1, V planes, then zipped back to 32 pixels.
+static void ycrcbRowNeon(const unsigned char *s, unsigned char *d, int n) {
+	int i = 0;
+	for(; i + 16 <= n; i += 16) {
+		uint8x16x4_t in = vld4q_u8(s + (i << 2));
+		uint8x16x2_t y = vzipq_u8(in.val[0], in.val[2]);
+		uint8x16x2_t u = vzipq_u8(in.val[1], in.val[1]);
+		uint8x16x2_t v = vzipq_u8(in.val[3], in.val[3]);
+		uint8x16x3_t out;
+		out.val[0] = y.val[0];
+		out.val[1] = u.val[0];
+		out.val[2] = v.val[0];
+		vst3q_u8(d + i * 6, out);
+		out.val[0] = y.val[1];
+		out.val[1] = u.val[1];
+		out.val[2] = v.val[1];
+		vst3q_u8(d + i * 6 + 48, out);
+	}
+	ycrcbRowScalar(s + (i << 2), d + i * 6, n - i);
+}
+
+static void accumulateRowNeon(const unsigned char *s, unsigned short *acc, int n) {
+	int i = 0;
+	for(; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8(s + i);
+		vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(v)));
+		vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(v)));
+	}
+	accumulateRowScalar(s + i, acc + i, n - i);
+}
+
+static const RowKernels kernelsNeon = { "NEON", grayRowNeon, ycrcbRowNeon, accumulateRowNeon };
+#endif /* RETRIEVE_SIMD_NEON */
+
+static void yuyv2grayRows(int width, unsigned char *src, unsigned char *dst, cv::Rect &region, const RowKernels *k) {
+	unsigned char *s = src + (width << 1) * region.y + (region.x << 1);
+	int lineLen = width << 1;
+	for(int i = 0; i < region.height; i++) {
+		k->gray(s, dst, region.width);
+		s += lineLen;
+		dst += region.width;
+	}
+}
+
+static void yuyv2ycrcbRows(int width, unsigned char *src, unsigned char *dst, cv::Rect &region, const RowKernels *k) {
+	unsigned char *s = src + (width << 1) * region.y + ((region.x >> 1) << 2);
+	int lineLen = width << 1;
+	bool oddStart = (region.x & 1) == 1;
+	int pairs = (region.width - oddStart) >> 1;
+	bool oddEnd = ((region.width - oddStart) & 1) == 1;
+	for(int i = 0; i < region.height; i++) {
+		unsigned char *ss = s;
+		unsigned char *d = dst;
+		if(oddStart) {		// second pixel of a pair
+			*d++ = ss[2];
+			*d++ = ss[1];
+			*d++ = ss[3];
+			ss += 4;
+		}
+		k->ycrcb(ss, d, pairs);
+		ss += pairs << 2;
+		d += pairs * 6;
+		if(oddEnd) {		// first pixel of a pair
+			*d++ = ss[0];
+			*d++ = ss[1];
+			*d++ = ss[3];
+		}
+		s += lineLen;
+		dst += region.width * 3;
+	}
+}
+
+// Accumulator row of 16-bit column sums, at most 8 * 255 each.
+static unsigned short* accumulatorRow(int len) {
+	static thread_local std::vector<unsigned short> acc;
+	if(acc.size() < (size_t)len) {
+		acc.resize(len);
+	}
+	return acc.data();
+}
+
+// Sums 2**EXP source rows column-wise by the vector primitive, then folds the
+// columns horizontally. The sums are the same as in packedDown.
+template<RetrColorspace CS, int EXP>
+static void yuyvRowsDown(int width, int height, const unsigned char *src, unsigned char *dst, const RowKernels *k) {
+	const int denom = 1 << EXP;
+	const unsigned sh = EXP << 1;
+	int dw = width >> EXP;
+	int dh = height >> EXP;
+	int lineLen = width << 1;
+	int used = (dw << EXP) << 1;
+	unsigned short *acc = accumulatorRow(used);
+	for(int i = 0; i < dh; i++) {
+		memset(acc, 0, used * sizeof(unsigned short));
+		for(int r = 0; r < denom; r++) {
+			k->accumulate(src + lineLen * (i * denom + r), acc, used);
+		}
+		const unsigned short *a = acc;
+		for(int j = 0; j < dw; j++) {
+			unsigned sumY = 0, sumU = 0, sumV = 0;
+			for(int l = 0; l < denom >> 1; l++) {
+				sumY += a[0] + a[2];
+				if(CS != CS_GRAY) {
+					sumU += a[1];
+					sumV += a[3];
+				}
+				a += 4;
+			}
+			*dst++ = sumY >> sh;
+			if(CS != CS_GRAY) {
+				*dst++ = sumU >> (sh - 1);
+				*dst++ = sumV >> (sh - 1);
+			}
+		}
+	}
+}
+
+typedef void (*RowsDownKernel)(int width, int height, const unsigned char *src, unsigned char *dst, const RowKernels *k);
+
+// Kernels by colorspace index and downsampling exponent - 1.
+static constexpr RowsDownKernel yuyvRowsDownKernels[2][DS_OCT] = {
+	{ yuyvRowsDown<CS_GRAY, 1>, yuyvRowsDown<CS_GRAY, 2>, yuyvRowsDown<CS_GRAY, 3> },
+	{ yuyvRowsDown<CS_YCRCB, 1>, yuyvRowsDown<CS_YCRCB, 2>, yuyvRowsDown<CS_YCRCB, 3> }
+};
+
+static void yuyv_convert(int width, int height, unsigned char *src, unsigned char *dst, unsigned denominator, cv::Rect &region, RetrColorspace colorspace, const RowKernels *k) {
+	if(denominator == 1) {
+		if(colorspace == CS_GRAY) {
+			yuyv2grayRows(width, src, dst, region, k);
+		}
+		else {
+			yuyv2ycrcbRows(width, src, dst, region, k);
+		}
+	}
+	else {
+		yuyvRowsDownKernels[colorIndex(colorspace)][logTwo(denominator) - 1](width, height, src, dst, k);
+	}
+}
+
+static void yuyv_reference(int width, int height, unsigned char *src, unsigned char *dst, unsigned denominator, cv::Rect &region, RetrColorspace colorspace);
+
+// Converts a pseudo-random width x height frame with odd regions and all
+// denominators using both the kernels and the reference, and compares the
+// results.
+static bool kernelsMatchReference(const RowKernels *k, int width, int height) {
+	std::vector<unsigned char> src(width * height * 2);
+	unsigned seed = 12345 + width;
+	for(size_t i = 0; i < src.size(); i++) {
+		seed = seed * 1103515245 + 12345;
+		src[i] = seed >> 16;
+	}
+	// the whole frame, then odd starts and odd widths
+	cv::Rect regions[] = { cv::Rect(0, 0, width, height), cv::Rect(1, 0, width - 1, height),
+		cv::Rect(width > 4 ? 3 : 0, height > 2 ? 1 : 0, width > 8 ? width - 7 : 1, height > 2 ? height - 2 : height),
+		cv::Rect(width > 6 ? 6 : 0, 0, width > 6 ? (width - 6) / 2 | 1 : 1, (height + 1) / 2) };
+	std::vector<unsigned char> expected(width * height * 3), actual(width * height * 3);
+	for(int cs = CS_GRAY; cs <= CS_YCRCB; cs++) {
+		for(unsigned denom = 1; denom <= 8; denom <<= 1) {
+			for(size_t r = 0; r < (denom == 1 ? sizeof(regions) / sizeof(regions[0]) : 1); r++) {
+				std::fill(expected.begin(), expected.end(), 0);
+				std::fill(actual.begin(), actual.end(), 0);
+				yuyv_reference(width, height, src.data(), expected.data(), denom, regions[r], (RetrColorspace)cs);
+				yuyv_convert(width, height, src.data(), actual.data(), denom, regions[r], (RetrColorspace)cs, k);
+				if(expected != actual) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Compares the row primitives of k with the scalar ones for every length up
+// to max, so all the vector tails are covered.
+static bool primitivesMatchScalar(const RowKernels *k, int max) {
+	std::vector<unsigned char> src(max * 4);
+	unsigned seed = 54321;
+	for(size_t i = 0; i < src.size(); i++) {
+		seed = seed * 1103515245 + 12345;
+		src[i] = seed >> 16;
+	}
+	std::vector<unsigned char> expected(max * 6), actual(max * 6);
+	std::vector<unsigned short> expectedAcc(max), actualAcc(max);
+	for(int n = 0; n <= max; n++) {
+		std::fill(expected.begin(), expected.end(), 0);
+		std::fill(actual.begin(), actual.end(), 0);
+		grayRowScalar(src.data(), expected.data(), n);
+		k->gray(src.data(), actual.data(), n);
+		if(expected != actual) {
+			return false;
+		}
+		ycrcbRowScalar(src.data(), expected.data(), n);
+		k->ycrcb(src.data(), actual.data(), n);
+		if(expected != actual) {
+			return false;
+		}
+		std::fill(expectedAcc.begin(), expectedAcc.end(), 1000);
+		std::fill(actualAcc.begin(), actualAcc.end(), 1000);
+		accumulateRowScalar(src.data(), expectedAcc.data(), n);
+		k->accumulate(src.data(), actualAcc.data(), n);
+		if(expectedAcc != actualAcc) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Puts the vector kernel sets this CPU supports into sets from the slowest
+// to the fastest, returns their number. On x86 the set is chosen at runtime
+// by the CPU features, NEON is chosen at compile time.
+static int supportedKernels(const RowKernels **sets) {
+	int n = 0;
+#ifdef RETRIEVE_SIMD_X86
+	__builtin_cpu_init();
+	sets[n++] = &kernelsSse2;
+	if(__builtin_cpu_supports("ssse3")) {
+		sets[n++] = &kernelsSsse3;
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		sets[n++] = &kernelsAvx2;
+	}
+#endif /* RETRIEVE_SIMD_X86 */
+#ifdef RETRIEVE_SIMD_NEON
+	sets[n++] = &kernelsNeon;
+#endif /* RETRIEVE_SIMD_NEON */
+	(void)sets;
+	return n;
+}
+
+// Returns the fastest kernels supported by this CPU, or NULL for the scalar reference.
+static const RowKernels* selectKernels() {
+	const RowKernels *sets[3];
+	int n = supportedKernels(sets);
+	const RowKernels *k = n > 0 ? sets[n - 1] : NULL;
+	if(k != NULL && !kernelsMatchReference(k, 152, 24)) {
+		fprintf(stderr, "VIDEOIO WARNING: %s conversion kernels differ from the reference, using scalar ones.\n", k->name);
+		k = NULL;
+	}
+	return k;
+}
+
+int retrieve_check_kernels() {
+	const int sizes[][2] = { { 2, 1 }, { 6, 3 }, { 34, 9 }, { 66, 17 }, { 152, 24 }, { 258, 33 } };
+	const RowKernels *sets[3];
+	int n = supportedKernels(sets);
+	int failures = 0;
+	for(int i = 0; i < n; i++) {
+		bool ok = primitivesMatchScalar(sets[i], 100);
+		for(size_t j = 0; ok && j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			ok = kernelsMatchReference(sets[i], sizes[j][0], sizes[j][1]);
+		}
+		fprintf(stderr, "%s conversion kernels %s the reference\n", sets[i]->name, ok ? "match" : "differ from");
+		failures += !ok;
+	}
+	return failures;
+}
+
+static const RowKernels* rowKernels() {
+	static const RowKernels *kernels = selectKernels();
+	return kernels;
+}
+
+/********************************************************************************/
+
+static void yuyv_reference(int width, int height, unsigned char *src, unsigned char *dst, unsigned denominator, cv::Rect &region, RetrColorspace colorspace) {
+	if(denominator == 1) {
+		packedRegionKernels[0][colorIndex(colorspace)](width, src, dst, region);
+	}
+	else {
+		packedDownKernels[0][colorIndex(colorspace)][logTwo(denominator) - 1](width, height, src, dst);
+	}
+}
+
+void yuyv_to_propsDefined(int width, int height, unsigned char *src, unsigned char *dst, unsigned denominator, cv::Rect &region, RetrColorspace colorspace) {
+	const RowKernels *k = rowKernels();
+	if(k != NULL) {
+		yuyv_convert(width, height, src, dst, denominator, region, colorspace, k);
+	}
+	else {
+		yuyv_reference(width, height, src, dst, denominator, region, colorspace);
+	}
+}
+
+bool retrieve_resolve_target(unsigned width, unsigned height, const RetrieveProps &props, RetrieveTarget &target) {
+	target.colorspace = props.colorspace;
+	target.channels = props.getChannels();
+	target.denominator = props.getDenominator();
+	target.orientation = props.orientation;
+	target.remap = props.remap;
+	target.dst = NULL;
+	if(props.isTurned() && props.colorspace == CS_YCRCB_422P) {
+		return false;
+	}
+	if(props.remap != NULL) {	// the table alone gives the geometry
+		const RetrieveRemap &m = *props.remap;
+		if(props.isPlanar() || m.width <= 0 || m.height <= 0 || m.xy.size() != (size_t)m.width * m.height * 2) {
+			return false;
+		}
+		target.denominator = 1;
+		target.region = cv::Rect(0, 0, width, height);
+		target.width = m.width;
+		target.height = m.height;
+		target.cols = props.isTurned() ? target.height : target.width;
+		target.rows = props.isTurned() ? target.width : target.height;
+		return true;
+	}
+	if(target.denominator < 1 || target.denominator > 16) {
+		return false;
+	}
+	// make sure the region is valid
+	if(props.region.width > 0 && props.region.height > 0 &&
+		props.region.x >= 0 && props.region.y >= 0 &&
+		props.region.x + props.region.width <= width &&
+		props.region.y + props.region.height <= height) {
+		target.region = props.region;
+	}
+	else {		// otherwise we take the full image
+		target.region = cv::Rect(0, 0, width, height);
+	}
+	target.width = target.region.width / target.denominator;
+	target.height = target.region.height / target.denominator;
+	if(props.isPlanar()) {	// the chroma planes need whole pairs
+		target.width &= ~1;
+		if(props.colorspace == CS_YCRCB_420P) {
+			target.height &= ~1;
+		}
+	}
+	target.cols = props.isTurned() ? target.height : target.width;
+	target.rows = props.getRows(props.isTurned() ? target.width : target.height);
+	return target.width > 0 && target.height > 0;
+}
+
+void yuyv_to_targets(int width, int height, unsigned char *src, RetrieveTarget *targets, int count, int first, int last) {
+	// Walk the source in bands small enough to stay in cache while each target
+	// converts its part. The band height is a multiple of all the denominators.
+	const int band = count == 1 ? last - first : 1 << DS_OCT;
+	int lineLen = width << 1;
+	for(int y = first; y < last; y += band) {
+		int rows = last - y < band ? last - y : band;
+		for(int i = 0; i < count; i++) {
+			RetrieveTarget &t = targets[i];
+			int outLineLen = t.width * t.channels;
+			if(t.denominator > 1) {
+				yuyv_to_propsDefined(width, rows, src + lineLen * y,
+					t.dst + outLineLen * (y / t.denominator), t.denominator, t.region, t.colorspace);
+			}
+			else {
+				int top = y > t.region.y ? y : t.region.y;
+				int bottom = t.region.y + t.region.height;
+				if(bottom > y + rows) {
+					bottom = y + rows;
+				}
+				if(top < bottom) {
+					cv::Rect part(t.region.x, top, t.region.width, bottom - top);
+					yuyv_to_propsDefined(width, height, src,
+						t.dst + outLineLen * (top - t.region.y), 1, part, t.colorspace);
+				}
+			}
+		}
+	}
+}
+
+/********************************************************************************/
+/* Planar sources: gray frames and 4:2:0 frames with planar or interleaved
+   chroma. The luma plane is read straight, so gray output costs only a copy
+   or a box average, and color output reads one chroma pair per 2x2 pixels. */
+
+// Planes of a gray or 4:2:0 frame. The chroma sample (x, y) of the frame is
+// at u[y * chromaLine + x * chromaStep], u and v are NULL for gray frames.
+struct PlanarFrame {
+	int width, height;
+	const unsigned char *y, *u, *v;
+	int chromaStep, chromaLine;
+};
+
+static void planarFrame(const RetrieveSource &src, PlanarFrame &f) {
+	int lumaSize = src.width * src.height;
+	f.width = src.width;
+	f.height = src.height;
+	f.y = src.data;
+	switch(src.layout) {
+	case RL_NV12:
+		f.u = src.data + lumaSize;
+		f.v = f.u + 1;
+		f.chromaStep = 2;
+		f.chromaLine = src.width;
+		break;
+	case RL_YUV420:
+		f.u = src.data + lumaSize;
+		f.v = f.u + (lumaSize >> 2);
+		f.chromaStep = 1;
+		f.chromaLine = src.width >> 1;
+		break;
+	case RL_YVU420:
+		f.v = src.data + lumaSize;
+		f.u = f.v + (lumaSize >> 2);
+		f.chromaStep = 1;
+		f.chromaLine = src.width >> 1;
+		break;
+	default:	// RL_GREY
+		f.u = f.v = NULL;
+		f.chromaStep = f.chromaLine = 0;
+		break;
+	}
+}
+
+// Restricts f to the rows [top, top + rows), top is even.
+static PlanarFrame planarBand(const PlanarFrame &f, int top, int rows) {
+	PlanarFrame b = f;
+	b.height = rows;
+	b.y += top * f.width;
+	if(f.u != NULL) {
+		b.u += (top >> 1) * f.chromaLine;
+		b.v += (top >> 1) * f.chromaLine;
+	}
+	return b;
+}
+
+static void planar2gray(const PlanarFrame &f, unsigned char *dst, const cv::Rect &region) {
+	const unsigned char *s = f.y + f.width * region.y + region.x;
+	for(int i = 0; i < region.height; i++) {
+		memcpy(dst, s, region.width);
+		s += f.width;
+		dst += region.width;
+	}
+}
+
+// Each pixel gets the chroma of its 2x2 block, in the same Y, U, V order as
+// the YUYV conversion. Gray frames get neutral chroma.
+static void planar2ycrcb(const PlanarFrame &f, unsigned char *dst, const cv::Rect &region) {
+	for(int i = region.y; i < region.y + region.height; i++) {
+		const unsigned char *yy = f.y + f.width * i;
+		if(f.u == NULL) {
+			for(int x = region.x; x < region.x + region.width; x++) {
+				*dst++ = yy[x];
+				*dst++ = 128;
+				*dst++ = 128;
+			}
+			continue;
+		}
+		const unsigned char *uu = f.u + (i >> 1) * f.chromaLine;
+		const unsigned char *vv = f.v + (i >> 1) * f.chromaLine;
+		for(int x = region.x; x < region.x + region.width; x++) {
+			int c = (x >> 1) * f.chromaStep;
+			*dst++ = yy[x];
+			*dst++ = uu[c];
+			*dst++ = vv[c];
+		}
+	}
+}
+
+// Sums 2**EXP luma rows column-wise, the compiler vectorizes the inner loop.
+template<int EXP>
+static void planarLumaSums(const PlanarFrame &f, int row, unsigned short *acc, int used) {
+	memset(acc, 0, used * sizeof(unsigned short));
+	for(int r = 0; r < 1 << EXP; r++) {
+		const unsigned char *s = f.y + f.width * ((row << EXP) + r);
+		for(int x = 0; x < used; x++) {
+			acc[x] += s[x];
+		}
+	}
+}
+
+// Luma is averaged over 2**EXP x 2**EXP pixels, chroma over the 2**(EXP - 1)
+// squared samples covering the same block.
+template<RetrColorspace CS, int EXP>
+static void planarDown(const PlanarFrame &f, unsigned char *dst) {
+	const int denom = 1 << EXP;
+	const unsigned sh = EXP << 1;
+	const int cDenom = denom >> 1;
+	const unsigned csh = (EXP - 1) << 1;
+	int dw = f.width >> EXP;
+	int dh = f.height >> EXP;
+	int used = dw << EXP;
+	unsigned short *acc = accumulatorRow(used);
+	for(int i = 0; i < dh; i++) {
+		planarLumaSums<EXP>(f, i, acc, used);
+		const unsigned short *a = acc;
+		for(int j = 0; j < dw; j++) {
+			unsigned sumY = 0;
+			for(int l = 0; l < denom; l++) {
+				sumY += a[l];
+			}
+			a += denom;
+			*dst++ = sumY >> sh;
+			if(CS == CS_GRAY) {
+				continue;
+			}
+			if(f.u == NULL) {
+				*dst++ = 128;
+				*dst++ = 128;
+				continue;
+			}
+			unsigned sumU = 0, sumV = 0;
+			for(int k = 0; k < cDenom; k++) {
+				int c = (i * cDenom + k) * f.chromaLine + j * cDenom * f.chromaStep;
+				for(int l = 0; l < cDenom; l++) {
+					sumU += f.u[c];
+					sumV += f.v[c];
+					c += f.chromaStep;
+				}
+			}
+			*dst++ = sumU >> csh;
+			*dst++ = sumV >> csh;
+		}
+	}
+}
+
+typedef void (*PlanarDownKernel)(const PlanarFrame &f, unsigned char *dst);
+
+// Kernels by colorspace index and downsampling exponent - 1.
+static constexpr PlanarDownKernel planarDownKernels[2][DS_OCT] = {
+	{ planarDown<CS_GRAY, 1>, planarDown<CS_GRAY, 2>, planarDown<CS_GRAY, 3> },
+	{ planarDown<CS_YCRCB, 1>, planarDown<CS_YCRCB, 2>, planarDown<CS_YCRCB, 3> }
+};
+
+static void planar_convert(const PlanarFrame &f, unsigned char *dst, unsigned denominator, const cv::Rect &region, RetrColorspace colorspace) {
+	if(denominator == 1) {
+		if(colorspace == CS_GRAY) {
+			planar2gray(f, dst, region);
+		}
+		else {
+			planar2ycrcb(f, dst, region);
+		}
+	}
+	else {
+		planarDownKernels[colorIndex(colorspace)][logTwo(denominator) - 1](f, dst);
+	}
+}
+
+// Same banding as for YUYV, but each band is passed as a frame of its own.
+static void planar_to_targets(const RetrieveSource &src, RetrieveTarget *targets, int count, int first, int last) {
+	PlanarFrame f;
+	planarFrame(src, f);
+	const int band = count == 1 ? last - first : 1 << DS_OCT;
+	for(int y = first; y < last; y += band) {
+		int rows = last - y < band ? last - y : band;
+		PlanarFrame b = planarBand(f, y, rows);
+		for(int i = 0; i < count; i++) {
+			RetrieveTarget &t = targets[i];
+			int outLineLen = t.width * t.channels;
+			if(t.denominator > 1) {
+				planar_convert(b, t.dst + outLineLen * (y / t.denominator), t.denominator, t.region, t.colorspace);
+			}
+			else {
+				int top = y > t.region.y ? y : t.region.y;
+				int bottom = t.region.y + t.region.height;
+				if(bottom > y + rows) {
+					bottom = y + rows;
+				}
+				if(top < bottom) {
+					cv::Rect part(t.region.x, top - y, t.region.width, bottom - top);
+					planar_convert(b, t.dst + outLineLen * (top - t.region.y), 1, part, t.colorspace);
+				}
+			}
+		}
+	}
+}
+
+/********************************************************************************/
+/* Other packed sources: UYVY, 24 bit RGB and the BGGR and GBRG Bayer patterns.
+   They are converted straight into the targets too, the RGB ones through the
+   fixed point BT.601 transform of cv::cvtColor. Bayer frames are binned by
+   2x2 cells when downsampling, as each cell holds one red, two green and one
+   blue sample. */
+
+// Byte offsets of the samples in a packed 4:2:2 pixel pair, for the code
+// choosing the palette at runtime.
+struct PackedPair {
+	int y0, u, y1, v;
+};
+
+static const PackedPair uyvyPair = { 1, 0, 3, 2 };
+
+// Fixed point weights of the RGB to YCrCb transform with RGB_SHIFT fraction bits.
+enum { RGB_SHIFT = 14, RGB_R2Y = 4899, RGB_G2Y = 9617, RGB_B2Y = 1868, RGB_B2U = 9241, RGB_R2V = 11682 };
+
+static inline unsigned char clampByte(int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Writes the luma, for color output also the U and V of an RGB triplet to d,
+// and returns the position after them.
+static inline unsigned char* rgb2out(int r, int g, int b, unsigned char *d, RetrColorspace colorspace) {
+	const int half = 1 << (RGB_SHIFT - 1);
+	int y = (r * RGB_R2Y + g * RGB_G2Y + b * RGB_B2Y + half) >> RGB_SHIFT;
+	*d++ = y;
+	if(colorspace != CS_GRAY) {
+		*d++ = clampByte(((b - y) * RGB_B2U + (128 << RGB_SHIFT) + half) >> RGB_SHIFT);
+		*d++ = clampByte(((r - y) * RGB_R2V + (128 << RGB_SHIFT) + half) >> RGB_SHIFT);
+	}
+	return d;
+}
+
+// rOff and bOff are the offsets of red and blue in a pixel, green is in the middle.
+// Downsampling averages the components before the transform, which is linear.
+static void rgb_convert(const RetrieveSource &src, int rOff, int bOff, unsigned char *dst, unsigned denom, const cv::Rect &region, RetrColorspace colorspace) {
+	int lineLen = src.width * 3;
+	if(denom == 1) {
+		for(int i = region.y; i < region.y + region.height; i++) {
+			const unsigned char *s = src.data + lineLen * i + region.x * 3;
+			for(int j = region.width; j > 0; j--) {
+				dst = rgb2out(s[rOff], s[1], s[bOff], dst, colorspace);
+				s += 3;
+			}
+		}
+		return;
+	}
+	int dw = src.width / denom;
+	int dh = src.height / denom;
+	unsigned sh = logTwo(denom) << 1;
+	for(int i = 0; i < dh; i++) {
+		const unsigned char *row = src.data + lineLen * denom * i;
+		for(int j = 0; j < dw; j++) {
+			const unsigned char *s = row + denom * 3 * j;
+			unsigned sumR = 0, sumG = 0, sumB = 0;
+			for(unsigned k = 0; k < denom; k++) {
+				for(unsigned l = 0; l < denom * 3; l += 3) {
+					sumR += s[l + rOff];
+					sumG += s[l + 1];
+					sumB += s[l + bOff];
+				}
+				s += lineLen;
+			}
+			dst = rgb2out(sumR >> sh, sumG >> sh, sumB >> sh, dst, colorspace);
+		}
+	}
+}
+
+// (rx, ry) is the position of red in the 2x2 cells, blue is at the opposite corner.
+static void bayer_convert(const RetrieveSource &src, int rx, int ry, unsigned char *dst, unsigned denom, const cv::Rect &region, RetrColorspace colorspace) {
+	int w = src.width;
+	if(denom == 1) {
+		// Any 2x2 window holds all three colors, each pixel takes the one
+		// starting at it, stepping back at the last row and column.
+		for(int i = region.y; i < region.y + region.height; i++) {
+			int y0 = i < src.height - 1 ? i : i - 1;
+			const unsigned char *row = src.data + w * y0;
+			int rRow = ((ry ^ y0) & 1) * w;
+			int bRow = w - rRow;
+			for(int x = region.x; x < region.x + region.width; x++) {
+				int x0 = x < w - 1 ? x : x - 1;
+				const unsigned char *s = row + x0;
+				int rCol = (rx ^ x0) & 1;
+				int g = (s[rRow + (rCol ^ 1)] + s[bRow + rCol]) >> 1;
+				dst = rgb2out(s[rRow + rCol], g, s[bRow + (rCol ^ 1)], dst, colorspace);
+			}
+		}
+		return;
+	}
+	int dw = w / denom;
+	int dh = src.height / denom;
+	unsigned sh = logTwo(denom) << 1;
+	int r = w * ry + rx;
+	int b = w * (ry ^ 1) + (rx ^ 1);
+	int g0 = w * ry + (rx ^ 1);
+	int g1 = w * (ry ^ 1) + rx;
+	for(int i = 0; i < dh; i++) {
+		const unsigned char *row = src.data + w * denom * i;
+		for(int j = 0; j < dw; j++) {
+			const unsigned char *s = row + denom * j;
+			unsigned sumR = 0, sumG = 0, sumB = 0;
+			for(unsigned k = 0; k < denom; k += 2) {
+				for(unsigned l = 0; l < denom; l += 2) {
+					sumR += s[l + r];
+					sumG += s[l + g0] + s[l + g1];
+					sumB += s[l + b];
+				}
+				s += w << 1;
+			}
+			// a block holds a quarter as many red and blue samples as pixels, and half as many green
+			dst = rgb2out(sumR >> (sh - 2), sumG >> (sh - 1), sumB >> (sh - 2), dst, colorspace);
+		}
+	}
+}
+
+static void packed_convert(const RetrieveSource &src, unsigned char *dst, unsigned denominator, const cv::Rect &region, RetrColorspace colorspace) {
+	switch(src.layout) {
+	case RL_UYVY:
+		if(denominator == 1) {
+			packedRegionKernels[1][colorIndex(colorspace)](src.width, src.data, dst, region);
+		}
+		else {
+			packedDownKernels[1][colorIndex(colorspace)][logTwo(denominator) - 1](src.width, src.height, src.data, dst);
+		}
+		break;
+	case RL_BGR24:
+		rgb_convert(src, 2, 0, dst, denominator, region, colorspace);
+		break;
+	case RL_RGB24:
+		rgb_convert(src, 0, 2, dst, denominator, region, colorspace);
+		break;
+	case RL_SBGGR8:
+		bayer_convert(src, 1, 1, dst, denominator, region, colorspace);
+		break;
+	default:	// RL_SGBRG8
+		bayer_convert(src, 0, 1, dst, denominator, region, colorspace);
+		break;
+	}
+}
+
+// Same banding as for YUYV. Downsampling targets get each band as a frame of
+// its own, the others the whole frame, because Bayer pixels look one row ahead.
+static void packed_to_targets(const RetrieveSource &src, RetrieveTarget *targets, int count, int first, int last) {
+	int lineLen = src.width;
+	if(src.layout == RL_UYVY) {
+		lineLen <<= 1;
+	}
+	else if(src.layout == RL_BGR24 || src.layout == RL_RGB24) {
+		lineLen *= 3;
+	}
+	const int band = count == 1 ? last - first : 1 << DS_OCT;
+	for(int y = first; y < last; y += band) {
+		int rows = last - y < band ? last - y : band;
+		RetrieveSource b = src;
+		b.data += lineLen * y;
+		b.height = rows;
+		for(int i = 0; i < count; i++) {
+			RetrieveTarget &t = targets[i];
+			int outLineLen = t.width * t.channels;
+			if(t.denominator > 1) {
+				packed_convert(b, t.dst + outLineLen * (y / t.denominator), t.denominator, t.region, t.colorspace);
+			}
+			else {
+				int top = y > t.region.y ? y : t.region.y;
+				int bottom = t.region.y + t.region.height;
+				if(bottom > y + rows) {
+					bottom = y + rows;
+				}
+				if(top < bottom) {
+					cv::Rect part(t.region.x, top, t.region.width, bottom - top);
+					packed_convert(src, t.dst + outLineLen * (top - t.region.y), 1, part, t.colorspace);
+				}
+			}
+		}
+	}
+}
+
+/********************************************************************************/
+/* Area averaging for any integer scale over any region, used where the kernels
+   above can't go: they downsample only the whole frame by 2, 4 or 8. Each
+   source pixel is expanded to three components, summed column-wise over the
+   rows of an output row, then the columns are folded by the scale. The block
+   average is the exact floor taken by a fixed point reciprocal, so there is
+   no division per pixel. */
+
+static const PackedPair yuyvPair = { 0, 1, 2, 3 };
+
+static bool rgbLayout(RetrieveLayout layout) {
+	return layout == RL_BGR24 || layout == RL_RGB24 || layout == RL_SBGGR8 || layout == RL_SGBRG8;
+}
+
+// Adds the components of the pixels [x0, x0 + n) in row y to the column sums
+// in c0, c1 and c2. These are red, green and blue for the RGB sources, luma
+// and chroma for the others, when chroma is needed only.
+static void areaRow(const RetrieveSource &src, int y, int x0, int n, bool chroma, unsigned short *c0, unsigned short *c1, unsigned short *c2) {
+	int w = src.width;
+	switch(src.layout) {
+	case RL_YUYV:
+	case RL_UYVY: {
+		const PackedPair &p = src.layout == RL_YUYV ? yuyvPair : uyvyPair;
+		const unsigned char *s = src.data + (w << 1) * y;
+		for(int i = 0; i < n; i++) {
+			int x = x0 + i;
+			const unsigned char *pair = s + ((x >> 1) << 2);
+			c0[i] += pair[x & 1 ? p.y1 : p.y0];
+			if(chroma) {
+				c1[i] += pair[p.u];
+				c2[i] += pair[p.v];
+			}
+		}
+		break;
+	}
+	case RL_GREY:
+	case RL_NV12:
+	case RL_YUV420:
+	case RL_YVU420: {
+		PlanarFrame f;
+		planarFrame(src, f);
+		const unsigned char *yy = f.y + w * y + x0;
+		for(int i = 0; i < n; i++) {
+			c0[i] += yy[i];
+		}
+		if(!chroma) {
+			break;
+		}
+		if(f.u == NULL) {
+			for(int i = 0; i < n; i++) {
+				c1[i] += 128;
+				c2[i] += 128;
+			}
+			break;
+		}
+		const unsigned char *uu = f.u + (y >> 1) * f.chromaLine;
+		const unsigned char *vv = f.v + (y >> 1) * f.chromaLine;
+		for(int i = 0; i < n; i++) {
+			int c = ((x0 + i) >> 1) * f.chromaStep;
+			c1[i] += uu[c];
+			c2[i] += vv[c];
+		}
+		break;
+	}
+	case RL_YUV24: {
+		const unsigned char *s = src.data + (w * y + x0) * 3;
+		for(int i = 0; i < n; i++) {
+			c0[i] += s[0];
+			if(chroma) {
+				c1[i] += s[1];
+				c2[i] += s[2];
+			}
+			s += 3;
+		}
+		break;
+	}
+	case RL_BGR24:
+	case RL_RGB24: {
+		int rOff = src.layout == RL_BGR24 ? 2 : 0;
+		const unsigned char *s = src.data + (w * y + x0) * 3;
+		for(int i = 0; i < n; i++) {
+			c0[i] += s[rOff];
+			c1[i] += s[1];
+			c2[i] += s[rOff ^ 2];
+			s += 3;
+		}
+		break;
+	}
+	default: {	// Bayer, the same 2x2 windows as in bayer_convert
+		int rx = src.layout == RL_SBGGR8 ? 1 : 0;
+		int ry = 1;
+		int y0 = y < src.height - 1 ? y : y - 1;
+		const unsigned char *row = src.data + w * y0;
+		int rRow = ((ry ^ y0) & 1) * w;
+		int bRow = w - rRow;
+		for(int i = 0; i < n; i++) {
+			int x = x0 + i;
+			int xx = x < w - 1 ? x : x - 1;
+			const unsigned char *s = row + xx;
+			int rCol = (rx ^ xx) & 1;
+			c0[i] += s[rRow + rCol];
+			c1[i] += (s[rRow + (rCol ^ 1)] + s[bRow + rCol]) >> 1;
+			c2[i] += s[bRow + (rCol ^ 1)];
+		}
+		break;
+	}
+	}
+}
+
+// Averages the region in blocks of dx x dy pixels into width x height output
+// pixels. The output is interleaved as the colorspace says, or the U and V
+// planes at dst and v if v is not NULL.
+static void area_average(const RetrieveSource &src, const cv::Rect &region, unsigned dx, unsigned dy, int width, int height,
+		RetrColorspace colorspace, unsigned char *dst, unsigned char *v) {
+	bool rgb = rgbLayout(src.layout);
+	bool color = colorspace != CS_GRAY;
+	bool three = rgb || color;
+	int used = width * dx;
+	// a column sums at most 32 rows, 32 * 255 fits in 16 bits
+	unsigned short *c0 = accumulatorRow(used * 3);
+	unsigned short *c1 = c0 + used;
+	unsigned short *c2 = c1 + used;
+	// the reciprocal of the block size rounded up in 32 fraction bits gives
+	// the exact floor of the average, as the block sum is below 2^32 / (n - 1)
+	// for blocks up to 32 x 32, so a saturated block stays 255
+	unsigned n = dx * dy;
+	uint64_t recip = ((1ull << 32) + n - 1) / n;
+	for(int i = 0; i < height; i++) {
+		memset(c0, 0, used * (three ? 3 : 1) * sizeof(unsigned short));
+		for(unsigned k = 0; k < dy; k++) {
+			areaRow(src, region.y + i * dy + k, region.x, used, three, c0, c1, c2);
+		}
+		for(int j = 0; j < width; j++) {
+			unsigned s0 = 0, s1 = 0, s2 = 0;
+			for(unsigned l = j * dx; l < (j + 1) * dx; l++) {
+				s0 += c0[l];
+				if(three) {
+					s1 += c1[l];
+					s2 += c2[l];
+				}
+			}
+			unsigned char pixel[3];
+			pixel[0] = (s0 * recip) >> 32;
+			pixel[1] = (s1 * recip) >> 32;
+			pixel[2] = (s2 * recip) >> 32;
+			if(rgb) {
+				rgb2out(pixel[0], pixel[1], pixel[2], pixel, CS_YCRCB);
+			}
+			if(v != NULL) {
+				*dst++ = pixel[1];
+				*v++ = pixel[2];
+			}
+			else {
+				*dst++ = pixel[0];
+				if(color) {
+					*dst++ = pixel[1];
+					*dst++ = pixel[2];
+				}
+			}
+		}
+	}
+}
+
+// Returns in top and bottom the output rows of a target with rows rows that
+// fall to the source rows [first, last) of a frame of height rows. The parts
+// of a frame give each output row exactly once.
+static void partRows(int rows, int height, int first, int last, int &top, int &bottom) {
+	top = (int)((long)rows * first / height);
+	bottom = last == height ? rows : (int)((long)rows * last / height);
+}
+
+static void area_convert(const RetrieveSource &src, const RetrieveTarget &t, int first, int last) {
+	int top, bottom;
+	partRows(t.height, src.height, first, last, top, bottom);
+	cv::Rect region = t.region;
+	region.y += top * t.denominator;
+	area_average(src, region, t.denominator, t.denominator, t.width, bottom - top, t.colorspace,
+		t.dst + t.width * t.channels * top, NULL);
+}
+
+static int chromaHeight(const RetrieveTarget &t) {
+	return t.colorspace == CS_YCRCB_420P ? t.height >> 1 : t.height;
+}
+
+// Fills the chroma rows [top, bottom) of a planar target into u and v, each
+// sample averaged over the pixels it covers.
+static void chroma_rows(const RetrieveSource &src, const RetrieveTarget &t, int top, int bottom, unsigned char *u, unsigned char *v) {
+	unsigned d = t.denominator;
+	unsigned dy = t.colorspace == CS_YCRCB_420P ? d << 1 : d;
+	cv::Rect region = t.region;
+	region.y += top * dy;
+	if(d == 1 && (region.x & 1) == 0 && (src.layout == RL_YUYV || src.layout == RL_UYVY)) {
+		// each sample is a pair, or the floor average of two for 4:2:0, like in area_average
+		const PackedPair &p = src.layout == RL_YUYV ? yuyvPair : uyvyPair;
+		int lineLen = src.width << 1;
+		int width = t.width >> 1;
+		for(int i = 0; i < bottom - top; i++) {
+			const unsigned char *s0 = src.data + lineLen * (region.y + i * dy) + (region.x << 1);
+			const unsigned char *s1 = dy == 2 ? s0 + lineLen : s0;
+			for(int j = 0; j < width; j++) {
+				*u++ = (s0[p.u] + s1[p.u]) >> 1;
+				*v++ = (s0[p.v] + s1[p.v]) >> 1;
+				s0 += 4;
+				s1 += 4;
+			}
+		}
+		return;
+	}
+	area_average(src, region, d << 1, dy, t.width >> 1, bottom - top, CS_YCRCB, u, v);
+}
+
+// True if the target can go through the banded kernels of the layout.
+static bool bandedTarget(const RetrieveSource &src, const RetrieveTarget &t) {
+	unsigned d = t.denominator;
+	if(src.layout == RL_YUV24) {
+		return false;
+	}
+	return d == 1 || ((d & (d - 1)) == 0 && d <= (1 << DS_OCT) &&
+		t.region.x == 0 && t.region.y == 0 && t.region.width == src.width && t.region.height == src.height &&
+		t.width == src.width / (int)d && t.height == src.height / (int)d);
+}
+
+/********************************************************************************/
+/* Orientation and remapping. The output is converted in bands of rows before
+   orientation into a buffer staying in cache, and each band is written to its
+   final place at once, so the output is not walked a second time. Remapped
+   pixels are sampled straight from the source. */
+
+// Band buffer of the oriented conversion, followed by the chroma planes.
+static unsigned char* orientBuffer(int len) {
+	static thread_local std::vector<unsigned char> buffer;
+	if(buffer.size() < (size_t)len) {
+		buffer.resize(len);
+	}
+	return buffer.data();
+}
+
+// Reads the components of pixel (x, y) into c like areaRow does, the chroma
+// only if three is set. f holds the planes of the gray and 4:2:0 layouts.
+static inline void pixelAt(const RetrieveSource &src, const PlanarFrame &f, int x, int y, bool three, int *c) {
+	int w = src.width;
+	switch(src.layout) {
+	case RL_YUYV:
+	case RL_UYVY: {
+		const PackedPair &p = src.layout == RL_YUYV ? yuyvPair : uyvyPair;
+		const unsigned char *pair = src.data + (w << 1) * y + ((x >> 1) << 2);
+		c[0] = pair[x & 1 ? p.y1 : p.y0];
+		c[1] = pair[p.u];
+		c[2] = pair[p.v];
+		break;
+	}
+	case RL_GREY:
+	case RL_NV12:
+	case RL_YUV420:
+	case RL_YVU420:
+		c[0] = f.y[w * y + x];
+		if(three) {
+			int i = (y >> 1) * f.chromaLine + (x >> 1) * f.chromaStep;
+			c[1] = f.u == NULL ? 128 : f.u[i];
+			c[2] = f.v == NULL ? 128 : f.v[i];
+		}
+		break;
+	case RL_YUV24: {
+		const unsigned char *s = src.data + (w * y + x) * 3;
+		c[0] = s[0];
+		c[1] = s[1];
+		c[2] = s[2];
+		break;
+	}
+	case RL_BGR24:
+	case RL_RGB24: {
+		int rOff = src.layout == RL_BGR24 ? 2 : 0;
+		const unsigned char *s = src.data + (w * y + x) * 3;
+		c[0] = s[rOff];
+		c[1] = s[1];
+		c[2] = s[rOff ^ 2];
+		break;
+	}
+	default: {	// Bayer, the same 2x2 windows as in bayer_convert
+		int rx = src.layout == RL_SBGGR8 ? 1 : 0;
+		int ry = 1;
+		int y0 = y < src.height - 1 ? y : y - 1;
+		int xx = x < w - 1 ? x : x - 1;
+		const unsigned char *s = src.data + w * y0 + xx;
+		int rRow = ((ry ^ y0) & 1) * w;
+		int bRow = w - rRow;
+		int rCol = (rx ^ xx) & 1;
+		c[0] = s[rRow + rCol];
+		c[1] = (s[rRow + (rCol ^ 1)] + s[bRow + rCol]) >> 1;
+		c[2] = s[bRow + (rCol ^ 1)];
+		break;
+	}
+	}
+}
+
+// Samples the rows [top, top + rows) of the remapped output bilinearly into dst.
+static void remap_rows(const RetrieveSource &src, const RetrieveTarget &t, int top, int rows, unsigned char *dst) {
+	const int one = 1 << RETRIEVE_REMAP_BITS;
+	const int half = 1 << (2 * RETRIEVE_REMAP_BITS - 1);
+	int maxX = (src.width - 1) << RETRIEVE_REMAP_BITS;
+	int maxY = (src.height - 1) << RETRIEVE_REMAP_BITS;
+	bool rgb = rgbLayout(src.layout);
+	bool color = t.colorspace != CS_GRAY;
+	bool three = rgb || color;
+	int n = three ? 3 : 1;
+	PlanarFrame f = PlanarFrame();
+	if(src.layout == RL_GREY || src.layout == RL_NV12 || src.layout == RL_YUV420 || src.layout == RL_YVU420) {
+		planarFrame(src, f);
+	}
+	const int *xy = t.remap->xy.data() + 2 * t.width * top;
+	for(int i = rows * t.width; i > 0; i--) {
+		// the border pixels repeat outside the frame
+		int sx = std::min(std::max(xy[0], 0), maxX);
+		int sy = std::min(std::max(xy[1], 0), maxY);
+		xy += 2;
+		int x = sx >> RETRIEVE_REMAP_BITS;
+		int y = sy >> RETRIEVE_REMAP_BITS;
+		int fx = sx & (one - 1);
+		int fy = sy & (one - 1);
+		int p00[3], p10[3], p01[3], p11[3];
+		pixelAt(src, f, x, y, three, p00);
+		pixelAt(src, f, x + (fx != 0), y, three, p10);
+		pixelAt(src, f, x, y + (fy != 0), three, p01);
+		pixelAt(src, f, x + (fx != 0), y + (fy != 0), three, p11);
+		int pixel[3];
+		for(int c = 0; c < n; c++) {
+			pixel[c] = (((p00[c] * (one - fx) + p10[c] * fx) * (one - fy) +
+				(p01[c] * (one - fx) + p11[c] * fx) * fy) + half) >> (2 * RETRIEVE_REMAP_BITS);
+		}
+		if(rgb) {
+			dst = rgb2out(pixel[0], pixel[1], pixel[2], dst, t.colorspace);
+		}
+		else {
+			*dst++ = pixel[0];
+			if(color) {
+				*dst++ = pixel[1];
+				*dst++ = pixel[2];
+			}
+		}
+	}
+}
+
+// Writes the rows [top, top + rows) of a width x height image of channels
+// interleaved components from band to their place in the oriented image at dst.
+static void orient_rows(const unsigned char *band, int width, int height, int channels, int top, int rows,
+		RetrOrientation orientation, unsigned char *dst) {
+	for(int y = top; y < top + rows; y++) {
+		int base, step;
+		switch(orientation) {
+		case OR_FLIP_HORIZONTAL:
+			base = width * y + width - 1;
+			step = -1;
+			break;
+		case OR_FLIP_VERTICAL:
+			base = width * (height - 1 - y);
+			step = 1;
+			break;
+		case OR_ROTATE_90:	// (x, y) goes to (height - 1 - y, x)
+			base = height - 1 - y;
+			step = height;
+			break;
+		case OR_ROTATE_180:
+			base = width * (height - 1 - y) + width - 1;
+			step = -1;
+			break;
+		case OR_ROTATE_270:	// (x, y) goes to (y, width - 1 - x)
+			base = height * (width - 1) + y;
+			step = -height;
+			break;
+		default:
+			base = width * y;
+			step = 1;
+			break;
+		}
+		unsigned char *d = dst + base * channels;
+		step *= channels;
+		if(channels == 1) {
+			for(int x = 0; x < width; x++) {
+				*d = *band++;
+				d += step;
+			}
+		}
+		else {
+			for(int x = 0; x < width; x++) {
+				d[0] = band[0];
+				d[1] = band[1];
+				d[2] = band[2];
+				band += 3;
+				d += step;
+			}
+		}
+	}
+}
+
+// Bytes per row of the layouts kept in a single plane, 0 for the 4:2:0 ones.
+static int rowBytes(RetrieveLayout layout, int width) {
+	switch(layout) {
+	case RL_NV12:
+	case RL_YUV420:
+	case RL_YVU420:
+		return 0;
+	case RL_YUYV:
+	case RL_UYVY:
+		return width << 1;
+	case RL_BGR24:
+	case RL_RGB24:
+	case RL_YUV24:
+		return width * 3;
+	default:
+		return width;
+	}
+}
+
+static void convert_part(const RetrieveSource &src, RetrieveTarget *targets, int count, int first, int last);
+
+// Converts the part of a target with orientation or remap table falling to
+// the source rows [first, last). Downsampled bands of the whole frame are cut
+// from a single plane source, so they run through the same kernels as
+// without orientation.
+static void oriented_convert(const RetrieveSource &src, const RetrieveTarget &t, int first, int last) {
+	int topFirst, topLast;
+	partRows(t.height, src.height, first, last, topFirst, topLast);
+	if(t.orientation == OR_NONE) {	// only remapped, straight to the output
+		remap_rows(src, t, topFirst, topLast - topFirst, t.dst + t.width * t.channels * topFirst);
+		return;
+	}
+	bool planar = t.colorspace == CS_YCRCB_422P || t.colorspace == CS_YCRCB_420P;
+	// the interleaved output or the Y plane before orientation
+	RetrieveTarget plain = t;
+	plain.orientation = OR_NONE;
+	plain.remap = NULL;
+	if(planar) {	// as in frame_to_targets
+		plain.colorspace = CS_GRAY;
+		plain.channels = 1;
+		plain.region.width = t.width * t.denominator;
+		plain.region.height = t.height * t.denominator;
+	}
+	int chromaWidth = t.width >> 1;
+	int chromaTop = 0, chromaBottom = 0;
+	if(planar) {
+		partRows(chromaHeight(t), src.height, first, last, chromaTop, chromaBottom);
+	}
+	int lineLen = rowBytes(src.layout, src.width);
+	bool sliced = lineLen > 0 && t.denominator > 1 && bandedTarget(src, plain);
+	const int band = 1 << DS_OCT;
+	int bandLen = t.width * band * plain.channels;
+	int chromaLen = chromaWidth * (chromaBottom - chromaTop);
+	unsigned char *buffer = orientBuffer(bandLen + chromaLen * 2);
+	for(int top = topFirst; top < topLast; top += band) {
+		int rows = std::min(band, topLast - top);
+		if(t.remap != NULL) {
+			remap_rows(src, t, top, rows, buffer);
+		}
+		else {
+			RetrieveSource slice = src;
+			RetrieveTarget part = plain;
+			if(sliced) {
+				slice.data += lineLen * top * t.denominator;
+				slice.height = rows * t.denominator;
+				part.region.y = 0;
+			}
+			else {
+				part.region.y += top * t.denominator;
+			}
+			part.region.height = rows * t.denominator;
+			part.height = part.rows = rows;
+			part.cols = part.width;
+			part.dst = buffer;
+			convert_part(slice, &part, 1, 0, slice.height);
+		}
+		orient_rows(buffer, t.width, t.height, plain.channels, top, rows, t.orientation, t.dst);
+	}
+	if(chromaLen > 0) {
+		int height = chromaHeight(t);
+		int rows = chromaBottom - chromaTop;
+		unsigned char *u = buffer + bandLen;
+		unsigned char *v = u + chromaLen;
+		chroma_rows(src, t, chromaTop, chromaBottom, u, v);
+		unsigned char *dst = t.dst + t.width * t.height;
+		orient_rows(u, chromaWidth, height, 1, chromaTop, rows, t.orientation, dst);
+		orient_rows(v, chromaWidth, height, 1, chromaTop, rows, t.orientation, dst + chromaWidth * height);
+	}
+}
+
+bool createRetrieveRemap(const cv::Mat &mapX, const cv::Mat &mapY, RetrieveRemap &remap) {
+	if(mapX.empty() || mapX.type() != CV_32FC1 || mapY.type() != CV_32FC1 || mapX.size() != mapY.size()) {
+		return false;
+	}
+	// far outside positions are clamped anyway, keep them from overflowing
+	const float limit = 1 << 16;
+	const float scale = 1 << RETRIEVE_REMAP_BITS;
+	remap.width = mapX.cols;
+	remap.height = mapX.rows;
+	remap.xy.resize((size_t)remap.width * remap.height * 2);
+	int *xy = remap.xy.data();
+	for(int y = 0; y < remap.height; y++) {
+		const float *mx = mapX.ptr<float>(y);
+		const float *my = mapY.ptr<float>(y);
+		for(int x = 0; x < remap.width; x++) {
+			*xy++ = cvRound(std::min(std::max(mx[x], -limit), limit) * scale);
+			*xy++ = cvRound(std::min(std::max(my[x], -limit), limit) * scale);
+		}
+	}
+	return true;
+}
+
+// Converts the part of each target falling to the source rows [first, last),
+// first is a multiple of the band height.
+static void convert_part(const RetrieveSource &src, RetrieveTarget *targets, int count, int first, int last) {
+	// the other targets share the pass over the source
+	RetrieveTarget banded[MAX_RETRIEVE_TARGETS];
+	int n = 0;
+	for(int i = 0; i < count; i++) {
+		RetrieveTarget t = targets[i];
+		if(t.orientation != OR_NONE || t.remap != NULL) {
+			oriented_convert(src, t, first, last);
+			continue;
+		}
+		if(t.colorspace == CS_YCRCB_422P || t.colorspace == CS_YCRCB_420P) {
+			int width = t.width >> 1;
+			int height = chromaHeight(t);
+			int top, bottom;
+			partRows(height, src.height, first, last, top, bottom);
+			unsigned char *u = t.dst + t.width * t.height + width * top;
+			chroma_rows(src, t, top, bottom, u, u + width * height);
+			// the Y plane is a gray target over the pixels kept
+			t.colorspace = CS_GRAY;
+			t.channels = 1;
+			t.region.width = t.width * t.denominator;
+			t.region.height = t.height * t.denominator;
+			t.rows = t.height;
+		}
+		if(n < MAX_RETRIEVE_TARGETS && bandedTarget(src, t)) {
+			banded[n++] = t;
+		}
+		else {
+			area_convert(src, t, first, last);
+		}
+	}
+	if(n == 0) {
+		return;
+	}
+	switch(src.layout) {
+	case RL_YUYV:
+		yuyv_to_targets(src.width, src.height, src.data, banded, n, first, last);
+		break;
+	case RL_GREY:
+	case RL_NV12:
+	case RL_YUV420:
+	case RL_YVU420:
+		planar_to_targets(src, banded, n, first, last);
+		break;
+	default:
+		packed_to_targets(src, banded, n, first, last);
+		break;
+	}
+}
+
+/********************************************************************************/
+/* Parallel conversion. Large frames are cut into horizontal bands converted
+   by a small pool of persistent workers and the calling thread, each band
+   for all the targets. Smaller frames stay on the calling thread, as waking
+   the workers would cost more than it saves. */
+
+// Persistent workers running the parts of one job at a time.
+class ConvertPool {
+public:
+	ConvertPool() : threads(0), job(NULL), count(0), next(0), pending(0), generation(0), stopping(false) {}
+
+	~ConvertPool() {
+		resize(0);
+	}
+
+	// Sets the number of worker threads, the caller of run helps them.
+	void resize(unsigned count) {
+		std::lock_guard<std::mutex> owner(busy);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for(size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+		workers.clear();
+		stopping = false;
+		for(unsigned i = 0; i < count; i++) {
+			workers.push_back(std::thread(&ConvertPool::loop, this));
+		}
+		threads = count;
+	}
+
+	// Returns the number of worker threads without waiting for a running job.
+	unsigned size() const {
+		return threads;
+	}
+
+	// Calls part(i) for each i in [0, parts) and returns when all are done.
+	// Returns false without calling anything if an other thread is using the
+	// pool or it has no workers.
+	bool run(int parts, const std::function<void(int)> &part) {
+		std::unique_lock<std::mutex> owner(busy, std::try_to_lock);
+		if(!owner.owns_lock() || workers.empty()) {
+			return false;
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		job = &part;
+		count = parts;
+		next = 0;
+		pending = parts;
+		generation++;
+		wake.notify_all();
+		work(lock);
+		finished.wait(lock, [this] { return pending == 0; });
+		job = NULL;
+		return true;
+	}
+
+private:
+	// Runs the parts not taken yet, with mutex locked by lock.
+	void work(std::unique_lock<std::mutex> &lock) {
+		while(next < count) {
+			int i = next++;
+			lock.unlock();
+			(*job)(i);
+			lock.lock();
+			if(--pending == 0) {
+				finished.notify_all();
+			}
+		}
+	}
+
+	void loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		unsigned long seen = generation;
+		for(;;) {
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if(stopping) {
+				return;
+			}
+			seen = generation;
+			work(lock);
+		}
+	}
+
+	std::mutex busy;	// held while a job runs or the workers change
+	std::mutex mutex;	// guards the fields below
+	std::condition_variable wake;
+	std::condition_variable finished;
+	std::vector<std::thread> workers;
+	std::atomic<unsigned> threads;
+	const std::function<void(int)> *job;
+	int count, next, pending;
+	unsigned long generation;
+	bool stopping;
+};
+
+static ConvertPool& convertPool() {
+	static ConvertPool pool;
+	return pool;
+}
+
+// 1280x720 and above go parallel by default, 640x480 does not
+static std::atomic<int> parallelMinPixels(500000);
+
+void retrieve_set_parallel(int threads, int minPixels) {
+	parallelMinPixels = minPixels;
+	ConvertPool &pool = convertPool();
+	unsigned workers = std::min(std::max(threads, 1), MAX_CONVERT_THREADS) - 1;
+	if(pool.size() != workers) {
+		pool.resize(workers);
+	}
+}
+
+void retrieve_get_parallel(int &threads, int &minPixels) {
+	threads = convertPool().size() + 1;
+	minPixels = parallelMinPixels;
+}
+
+void frame_to_targets(const RetrieveSource &src, RetrieveTarget *targets, int count) {
+	if(src.width * src.height >= parallelMinPixels) {
+		ConvertPool &pool = convertPool();
+		// the bands start at multiples of the band height of the kernels
+		int parts = pool.size() + 1;
+		int bounds[MAX_CONVERT_THREADS + 1];
+		for(int i = 0; i < parts; i++) {
+			bounds[i] = (src.height * i / parts) & ~((1 << DS_OCT) - 1);
+		}
+		bounds[parts] = src.height;
+		if(parts > 1 && pool.run(parts, [&](int i) { convert_part(src, targets, count, bounds[i], bounds[i + 1]); })) {
+			return;
+		}
+	}
+	convert_part(src, targets, count, 0, src.height);
+}
@@ -0,0 +1,68 @@
+/** @file
+Checks the vectorized conversion kernels against the scalar reference ones,
+and that averaging never overflows. Returns nonzero if any check fails. Run
+by ctest.
+
+Copyleft Balázs Bámer, 2015.
+*/
+
+#include "precomp.hpp"
+
+#include <cstdio>
+#include <vector>
+
+/**
+Converts a frame of all 255 samples at every scale into every colorspace
+from the YUV layouts, and returns the number of outputs having any other
+value. The averages of saturated blocks must stay 255.
+*/
+static int saturatedFailures() {
+	const int width = 224, height = 224;
+	std::vector<unsigned char> frame(width * height * 2, 255);
+	const RetrieveLayout layouts[] = { RL_YUYV, RL_UYVY, RL_NV12, RL_YUV420, RL_YVU420 };
+	const RetrColorspace colorspaces[] = { CS_GRAY, CS_YCRCB, CS_YCRCB_422P, CS_YCRCB_420P };
+	int failures = 0;
+	for(size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+		for(size_t c = 0; c < sizeof(colorspaces) / sizeof(colorspaces[0]); c++) {
+			for(unsigned scale = 1; scale <= 16; scale++) {
+				RetrieveProps props;
+				props.sampling = DS_ORIGINAL;
+				props.scale = scale;
+				props.colorspace = colorspaces[c];
+				RetrieveTarget target;
+				if(!retrieve_resolve_target(width, height, props, target)) {
+					continue;
+				}
+				std::vector<unsigned char> out(target.cols * target.rows * target.channels, 0);
+				target.dst = out.data();
+				RetrieveSource src;
+				src.layout = layouts[l];
+				src.width = width;
+				src.height = height;
+				src.data = frame.data();
+				frame_to_targets(src, &target, 1);
+				for(size_t i = 0; i < out.size(); i++) {
+					if(out[i] != 255) {
+						fprintf(stderr, "layout %d, colorspace %d, scale %u: byte %d is %d instead of 255\n",
+							(int)layouts[l], (int)colorspaces[c], scale, (int)i, (int)out[i]);
+						failures++;
+						break;
+					}
+				}
+			}
+		}
+	}
+	return failures;
+}
+
+int main() {
+	int failures = retrieve_check_kernels();
+	if(failures != 0) {
+		fprintf(stderr, "%d conversion kernel sets failed\n", failures);
+	}
+	int saturated = saturatedFailures();
+	if(saturated != 0) {
+		fprintf(stderr, "%d saturated conversions failed\n", saturated);
+	}
+	return failures != 0 || saturated != 0;
+}
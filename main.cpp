@@ -24,12 +24,16 @@
 #include <cctype>
 #include <csignal>
 #include <chrono>
+#include <vector>
+#include <string>
+#include <cstdlib>
 #include "still_config.h"
 #include "still.h"
 
 using namespace projector;
 
-cv::VideoCapture_mod capture;
+std::vector<cv::VideoCapture_mod*> captures;	// one for each camera
+std::vector<int> videoNums;	// device numbers of the cameras
 volatile bool started = false;
 char *incaseofBadalloc = NULL;
 
@@ -47,15 +51,83 @@ void sigabrtHandler(int signal) {
 	done();
 }
 
+// Parses the comma separated device numbers of -video-list, or takes -video-num if not given.
+bool parseVideoNums() {
+	if(Arguments::optVideoList == NULL) {
+		videoNums.push_back(Arguments::optVideoNum);
+		return true;
+	}
+	const char *p = Arguments::optVideoList;
+	for(;;) {
+		char *end;
+		long num = strtol(p, &end, 10);
+		if(end == p || num < 0 || num > 9) {
+			return false;
+		}
+		videoNums.push_back(num);
+		if(*end == 0) {
+			return true;
+		}
+		if(*end != ',') {
+			return false;
+		}
+		p = end + 1;
+	}
+}
+
+bool openCamera(cv::VideoCapture_mod &capture, int videoNum) {
+	capture.open(videoNum); //try to open as a video camera, through the use of an integer param
+	if (!capture.isOpened()) {
+		std::cerr << "Failed to open the video device " << videoNum << "!\n" << std::endl;
+		return false;
+	}
+	capture.set(CV_CAP_PROP_FRAME_WIDTH, 640);
+	capture.set(CV_CAP_PROP_FRAME_HEIGHT, 480);
+	capture.set(CAP_PROP_MOD_LEASE, Arguments::optZeroCopy);
+	capture.set(CV_CAP_PROP_BUFFERSIZE, Arguments::optBufferCount);
+	capture.set(CAP_PROP_MOD_DRAIN, Arguments::optDrainQueue);
+	capture.set(CAP_PROP_MOD_PROFILE, (Arguments::optStillSamplingPercent != 0 ? 1 << CS_GRAY : 0) | 1 << (Arguments::optPlanarFrames ? CS_YCRCB_420P : CS_YCRCB));
+	if(Arguments::optRecordFile != NULL) {
+		std::string file(Arguments::optRecordFile);
+		if(videoNums.size() > 1) {	// one recording for each camera
+			file += '.' + std::to_string(videoNum);
+		}
+		if(!capture.startRecording(cv::String(file), Arguments::optRecordCapacity)) {
+			std::cerr << "Failed to start recording, going on without it." << std::endl;
+		}
+	}
+	return true;
+}
+
 int init() {
 	incaseofBadalloc = new char[65536];
-	capture.open(Arguments::optVideoNum); //try to open as a video camera, through the use of an integer param
-    if (!capture.isOpened()) {
-	    std::cerr << "Failed to open the video device!\n" << std::endl;
-		return 1;
-    }
-	capture.set(CV_CAP_PROP_FRAME_WIDTH, 640);
-    capture.set(CV_CAP_PROP_FRAME_HEIGHT, 480);
+	if(Arguments::optReplayFile != NULL) {
+		cv::VideoCapture_mod *capture = new cv::VideoCapture_mod;
+		captures.push_back(capture);
+		capture->open(cv::String(Arguments::optReplayFile));	// the raw file backend is tried first
+	    if (!capture->isOpened()) {
+		    std::cerr << "Failed to open the recording!\n" << std::endl;
+			return 1;
+	    }
+		capture->set(CAP_PROP_MOD_REPLAY_PACED, Arguments::optReplayPaced);
+		capture->set(CAP_PROP_MOD_PREFETCH, Arguments::optPrefetchWindow);
+	}
+	else {
+		if(!parseVideoNums()) {
+		    std::cerr << "Invalid video device list!\n" << std::endl;
+			return 1;
+		}
+		for(size_t i = 0; i < videoNums.size(); i++) {
+			cv::VideoCapture_mod *capture = new cv::VideoCapture_mod;
+			captures.push_back(capture);
+			if(!openCamera(*capture, videoNums[i])) {
+				return 1;
+			}
+		}
+	}
+	// the conversion workers are shared by all the captures
+	captures[0]->set(CAP_PROP_MOD_CONVERT_MIN_PIXELS, Arguments::optConvertMinPixels);
+	captures[0]->set(CAP_PROP_MOD_CONVERT_THREADS, Arguments::optConvertThreads);
 	if(Arguments::optUseCurses) {
 		initscr();			/* Start curses mode		*/
 		cbreak();				/* Line buffering disabled	*/
@@ -74,11 +146,24 @@ int init() {
 int process() {
 	DEBDECP("main");
 	DEB1("starting...");
-	FrameProcessor frameProcessor;
-	StillFilter filter(capture, frameProcessor);	// use default handler
+	std::vector<FrameProcessor*> processors;
+	std::vector<StillFilter*> filters;
+	unsigned cores = std::thread::hardware_concurrency();
+	for(size_t i = 0; i < captures.size(); i++) {
+		// the saved files tell the cameras apart if there are more
+		FrameProcessor *processor = new FrameProcessor(captures.size() > 1 ? std::to_string(videoNums[i]) + "_" : std::string());
+		StillFilter *filter = new StillFilter(*captures[i], *processor);	// use default handler
+		if(captures.size() > 1 && cores > 1) {
+			filter->setAffinity(i % cores);	// a core for each camera
+		}
+		processors.push_back(processor);
+		filters.push_back(filter);
+	}
 	Showcase showcase("Image");
 	DEBSHOW(showcase);
-	filter.start();
+	for(size_t i = 0; i < filters.size(); i++) {
+		filters[i]->start();
+	}
 	started = true;
 	DEB1("started.");
 	while(started) {
@@ -87,14 +172,23 @@ int process() {
 		}
 	}
 	DEB1("stopping...");
-	filter.stop();
+	for(size_t i = 0; i < filters.size(); i++) {
+		filters[i]->stop();
+		delete filters[i];
+		delete processors[i];
+	}
 	DEB1("stopped.");
+	return 0;
 }
 
 void done() {
 	if(incaseofBadalloc != NULL) {
 		delete [] incaseofBadalloc;
 	}
+	for(size_t i = 0; i < captures.size(); i++) {
+		delete captures[i];
+	}
+	captures.clear();
 	if(Arguments::optUseCurses) {
 		endwin();			/* End curses mode		  */
 	}
@@ -115,6 +209,10 @@ int main(int argc, char** argv) {
 	if(Arguments::optHelp) {
 		return 0;
 	}
+	if(Arguments::optStillBenchmark) {
+		benchmarkStillCheck(stillDownsampling(Arguments::optStillDownsampleExponent, Arguments::optStillScale));
+		return 0;
+	}
 	int ret;
 	try {
 		ret = init();
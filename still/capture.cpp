@@ -0,0 +1,107 @@
+#include<time.h>
+#include<chrono>
+
+#include"capture.h"
+
+#if USE_NVWA == 1
+#include"debug_new.h"
+#endif
+
+
+using namespace projector;
+
+int projector::stillDownsampling(int optStillDownsampleExponent, int optStillScale) {
+	return optStillScale != 0 ? optStillScale : 1 << optStillDownsampleExponent;
+}
+
+void projector::fillRetrieveProps(RetrieveProps &props, int stillScale, bool forStillCheck) {
+    props.region.x = -1;    // use whole image
+    props.sampling = DS_ORIGINAL;
+    // mounted cameras are turned right in the conversion
+    props.orientation = (RetrOrientation)Arguments::optOrientation;
+    if(!forStillCheck) { // no check for still images
+    // we go direct for sharpness using YCrCb, planar only if the processors asked for it
+        props.scale = 0;
+        props.colorspace = Arguments::optPlanarFrames ? CS_YCRCB_420P : CS_YCRCB;
+    }
+    else {  // we check still images on a tiny resized image to eliminate
+        // camera shake
+        props.scale = stillScale;
+        props.colorspace = CS_GRAY;
+    }
+}
+
+long projector::frameAgeUs(const FrameInfo &info) {
+	if(info.timestampUs == 0) {
+		return -1;
+	}
+	// the driver stamps with CLOCK_MONOTONIC
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long)((int64)now.tv_sec * 1000000 + now.tv_nsec / 1000 - info.timestampUs);
+}
+
+CaptureStage::CaptureStage(cv::VideoCapture_mod& cap, int ringSize) : capture(cap), ring(ringSize) {
+	DEBPREF("capture");
+}
+
+void CaptureStage::run() {
+	std::vector<RetrieveProps> props;
+	std::vector<cv::Mat> frames;
+	int lastStillSamplingPercent = -1;	// force update on first run
+	int lastStillScale = -1;
+	while(started) {
+		int optStillSamplingPercent = Arguments::optStillSamplingPercent;
+		int stillScale = stillDownsampling(Arguments::optStillDownsampleExponent, Arguments::optStillScale);
+		if(lastStillSamplingPercent != optStillSamplingPercent || lastStillScale != stillScale) {
+			// the big frame is always the last one
+			props.resize(optStillSamplingPercent == 0 ? 1 : 2);
+			if(optStillSamplingPercent != 0) {
+				fillRetrieveProps(props[0], stillScale, true);
+			}
+			fillRetrieveProps(props.back(), stillScale, false);
+			lastStillSamplingPercent = optStillSamplingPercent;
+			lastStillScale = stillScale;
+		}
+
+		if(!capture.grab()) {
+			DEB1("grab failed.");
+			std::chrono::milliseconds dura(10);
+			std::this_thread::sleep_for(dura);
+			continue;
+		}
+		CapturedFrame *slot = ring.acquireWrite();
+		if(slot == NULL) {
+			// the consumer is too slow, this frame is lost without conversion
+			DEB2("ring overrun, total:", ring.getOverruns());
+			continue;
+		}
+		if(!capture.getFrameInfo(slot->frameInfo)) {
+			slot->frameInfo.timestampUs = 0;
+			slot->frameInfo.sequence = 0;
+			slot->frameInfo.dropped = 0;
+		}
+		// lend the buffers of the slot to the retrieval to avoid reallocation
+		frames.resize(props.size());
+		std::swap(frames.back(), slot->big);
+		if(props.size() > 1) {
+			std::swap(frames[0], slot->small);
+		}
+		bool ok = capture.retrieve(props, frames);
+		std::swap(frames.back(), slot->big);
+		if(props.size() > 1) {
+			std::swap(frames[0], slot->small);
+		}
+		else {
+			slot->small.release();
+		}
+		if(!ok) {
+			DEB1("retrieve failed.");
+			continue;
+		}
+		slot->queueDelayUs = frameAgeUs(slot->frameInfo);
+		DEB2("frame published, queue delay us:", slot->queueDelayUs);
+		ring.publish();
+	}
+	DEB2("loop is over, overruns:", ring.getOverruns());
+}
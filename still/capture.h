@@ -0,0 +1,248 @@
+/** @file
+Optional capture stage grabbing and converting frames in its own thread, and
+the bounded lock-free ring it publishes them into.
+
+Copyleft Balázs Bámer, 2015.
+*/
+
+#ifndef PROJECTOR_CAPTURE_H
+#define PROJECTOR_CAPTURE_H
+
+#include<atomic>
+#include<mutex>
+#include<condition_variable>
+#include<vector>
+#include<opencv2/core.hpp>
+
+#include"opencv2/videoio_mod.hpp"
+#include"still_config.h"
+#include"util.h"
+
+#if USE_NVWA == 1
+#include"debug_new.h"
+#endif
+
+
+namespace projector {
+
+	/**
+	Returns the integer downsampling factor of the still check, optStillScale if nonzero, otherwise 2**optStillDownsampleExponent.
+	*/
+	int stillDownsampling(int optStillDownsampleExponent, int optStillScale);
+
+	/**
+	Fills props for the small gray frame downsampled by stillScale used for still checking, or for the full-size YCrCb frame used for sharpness checking, planar 4:2:0 if optPlanarFrames is set, both oriented as optOrientation says.
+	*/
+	void fillRetrieveProps(RetrieveProps &props, int stillScale, bool forStillCheck);
+
+	/**
+	Returns the time in microseconds elapsed since the driver captured the frame, -1 if unknown.
+	*/
+	long frameAgeUs(const FrameInfo &info);
+
+	/**
+	One grabbed and converted frame in the ring.
+	*/
+	struct CapturedFrame {
+		/**
+		Small gray frame for still checking, empty if still checking was off at capture.
+		*/
+		cv::Mat small;
+
+		/**
+		Full-size YCrCb frame, interleaved or planar 4:2:0 as optPlanarFrames says.
+		*/
+		cv::Mat big;
+
+		/**
+		Driver-side information of the frame.
+		*/
+		FrameInfo frameInfo;
+
+		/**
+		Time in microseconds from the driver timestamp to the retrieval, -1 if unknown.
+		*/
+		long queueDelayUs;
+	};
+
+	/**
+	Bounded single producer, single consumer ring of preallocated frames. The
+	producer fills the slot returned by acquireWrite and then calls publish, the
+	consumer reads the slot returned by acquireRead or waitRead and then calls
+	release. The Mats in a slot may be swapped out by the consumer, the producer
+	reallocates them if needed. Only the indices are shared, so no locking is
+	needed. The mutex is taken only to put an empty-handed consumer to sleep and
+	to wake it up.
+	*/
+	class FrameRing {
+	protected:
+		/**
+		The slots, the frame with number n lives in slots[n % size].
+		*/
+		std::vector<CapturedFrame> slots;
+
+		/**
+		Number of frames published so far, written only by the producer.
+		*/
+		std::atomic<unsigned long> head;
+
+		/**
+		Number of frames released so far, written only by the consumer.
+		*/
+		std::atomic<unsigned long> tail;
+
+		/**
+		Number of frames the producer could not publish because the ring was full.
+		*/
+		std::atomic<unsigned long> overruns;
+
+		/**
+		True while the consumer sleeps in waitRead, so publish has to wake it.
+		*/
+		std::atomic<bool> sleeping;
+
+		/**
+		True after close, waitRead does not sleep any more. Guarded by waitMutex.
+		*/
+		bool closed;
+
+		/**
+		Guards closed and the sleep of the consumer.
+		*/
+		std::mutex waitMutex;
+
+		/**
+		Signalled on publish if the consumer sleeps, and on close.
+		*/
+		std::condition_variable published;
+	public:
+		/**
+		Creates a ring of size slots.
+		*/
+		FrameRing(int size) : slots(size), head(0), tail(0), overruns(0), sleeping(false), closed(false) {};
+
+		/**
+		Returns the slot to fill, or NULL and counts an overrun if the ring is full.
+		*/
+		CapturedFrame* acquireWrite() {
+			unsigned long h = head.load(std::memory_order_relaxed);
+			if(h - tail.load(std::memory_order_acquire) >= slots.size()) {
+				overruns.fetch_add(1, std::memory_order_relaxed);
+				return NULL;
+			}
+			return &slots[h % slots.size()];
+		}
+
+		/**
+		Makes the slot last returned by acquireWrite visible to the consumer, and wakes it if it waits.
+		*/
+		void publish() {
+			head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			// pairs with the fence in waitRead, so either this sees sleeping or the consumer sees the new head
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(sleeping.load(std::memory_order_relaxed)) {
+				std::lock_guard<std::mutex> lock(waitMutex);
+				published.notify_one();
+			}
+		}
+
+		/**
+		Returns the oldest published slot, or NULL if the ring is empty.
+		*/
+		CapturedFrame* acquireRead() {
+			unsigned long t = tail.load(std::memory_order_relaxed);
+			if(t == head.load(std::memory_order_acquire)) {
+				return NULL;
+			}
+			return &slots[t % slots.size()];
+		}
+
+		/**
+		Returns the oldest published slot, sleeping until publish if the ring is empty. Returns NULL only if the ring is empty and closed.
+		*/
+		CapturedFrame* waitRead() {
+			CapturedFrame *slot = acquireRead();
+			if(slot != NULL) {
+				return slot;
+			}
+			std::unique_lock<std::mutex> lock(waitMutex);
+			sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while((slot = acquireRead()) == NULL && !closed) {
+				published.wait(lock);
+			}
+			sleeping.store(false, std::memory_order_relaxed);
+			return slot;
+		}
+
+		/**
+		Wakes the consumer waiting in waitRead, and makes waitRead return without sleeping from now on.
+		*/
+		void close() {
+			std::lock_guard<std::mutex> lock(waitMutex);
+			closed = true;
+			published.notify_all();
+		}
+
+		/**
+		Gives the slot last returned by acquireRead back to the producer.
+		*/
+		void release() {
+			tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		/**
+		Returns the number of frames currently waiting for the consumer.
+		*/
+		unsigned long available() const {
+			return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+		}
+
+		/**
+		Returns the number of frames lost because the ring was full.
+		*/
+		unsigned long getOverruns() const {
+			return overruns.load(std::memory_order_relaxed);
+		}
+	};
+
+	/**
+	Grabs and retrieves frames in its own thread and publishes them into a
+	FrameRing. If still checking is on, both the small gray and the full-size
+	YCrCb frame are retrieved in one pass, because it is not known yet if the
+	frame will be needed in full size. The capture must not be used by other
+	threads while this is running.
+	*/
+	class CaptureStage : public StartStop {
+	protected:
+		/**
+		The initialized capture providing the video stream.
+		*/
+		cv::VideoCapture_mod& capture;
+
+		/**
+		The ring receiving the frames.
+		*/
+		FrameRing ring;
+	public:
+		/**
+		Constructs a new stage with a ring of ringSize slots without starting it.
+		*/
+		CaptureStage(cv::VideoCapture_mod& capture, int ringSize);
+
+		/**
+		Returns the ring for the consumer.
+		*/
+		FrameRing& getRing() {
+			return ring;
+		}
+
+	protected:
+		/**
+		Grabs and retrieves frames until stopped.
+		*/
+		virtual void run();
+	};
+}
+
+#endif
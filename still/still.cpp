@@ -5,6 +5,7 @@
 #include<iostream>
 #include<exception>
 #include<math.h>
+#include<string.h>
 #include<opencv2/imgcodecs.hpp>
 
 #include"still.h"
@@ -16,7 +17,7 @@
 
 using namespace projector;
 
-FrameProcessor::FrameProcessor() {
+FrameProcessor::FrameProcessor(const std::string &tag) : fileTag(tag) {
 	DEBPREF("proc");
 	current = RESULT_NOIMAGE;
 }
@@ -70,10 +71,17 @@ FrameProcStatus FrameProcessor::doProcess(const ProcessArgs *arg) {
 	DEB1("start");
 	// Let's use high-level OpenCV functions instead of doing it by hand.
 	// Here we have plenty of time here.
-	cv::Mat grayFrame(arg->frame->size(), CV_8U);
-	int mapping[] = {0, 0};
-	// copy only the brightness channel of the YCrCb image
-	cv::mixChannels(arg->frame, 1, &grayFrame, 1, mapping, 1);
+	cv::Mat grayFrame;
+	if(arg->frame->channels() == 1) {
+		// the Y plane of the planar frame is already the brightness
+		grayFrame = arg->frame->rowRange(0, arg->frame->rows * 2 / 3);
+	}
+	else {
+		grayFrame.create(arg->frame->size(), CV_8U);
+		int mapping[] = {0, 0};
+		// copy only the brightness channel of the YCrCb image
+		cv::mixChannels(arg->frame, 1, &grayFrame, 1, mapping, 1);
+	}
 	// the mask has initially half brightness
 	cv::Mat mask(grayFrame.size(), CV_8U);
 	mask = cv::Scalar(127);
@@ -94,12 +102,14 @@ FrameProcStatus FrameProcessor::doProcess(const ProcessArgs *arg) {
 	}
 
 	cv::String fileName(OUTPUT_FILE_PREFIX);
+	fileName += fileTag.c_str();
 	fileName += std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()).c_str();
 	fileName += ".jpg";
 
 	std::vector<int> compression_params;
 	cv::imwrite(fileName, grayFrame, compression_params);
 	DEB1("JPEG ready.");
+	DEB2("latency from capture us:", arg->getAgeUs());
 	
 	return RESULT_EXACT;
 }
@@ -126,7 +136,7 @@ void FrameProcessor::die() {
 	finish = true;
 }
 
-StillFilter::StillFilter(cv::VideoCapture_mod& cap, FrameProcessor& handler) : capture(cap), processor(handler) {
+StillFilter::StillFilter(cv::VideoCapture_mod& cap, FrameProcessor& handler) : capture(cap), processor(handler), sharpDiffLow(-1), sharpDiffHigh(-1), stageRing(NULL) {
 	DEBPREF("filter");
 	started = false;
 }
@@ -136,6 +146,11 @@ void StillFilter::cleanup() {
 	if(processor.status() == RESULT_PROCESSING) {
 		processor.die();
 	}
+	// wake run() if it waits for a frame
+	std::lock_guard<std::mutex> lock(stageRingMutex);
+	if(stageRing != NULL) {
+		stageRing->close();
+	}
 }
 
 void StillFilter::run() {
@@ -143,9 +158,26 @@ void StillFilter::run() {
 	// using pointers to avoid copying here
 	cv::Mat *smallFrameLast = NULL;
 	int lastStillSamplingPercent = -1;	// force update on first run
-	int lastStillDownsampleExponent = -1;
+	int lastStillScale = -1;
 	ProcessArgs *staleArg = NULL;	// state is valid across several runs
 	bool keepAlive = started;	// this thread must live while there is a processing running
+	bool lastUnchanged = false;	// if the last frame was still, we expect the next one to be still as well
+	unsigned long lastDropped = 0;	// dropped frame count already reported
+	// small gray frame for change detection and big YCrCb frame for sharpness, retrieved in one pass
+	std::vector<RetrieveProps> stillProps(2);
+	// grabs and converts in an other thread if enabled, the capture must not be used here then
+	CaptureStage *stage = NULL;
+	if(Arguments::optAsyncCapture) {
+		stage = new CaptureStage(capture, Arguments::optRingSize);
+		stage->setAffinity(cpu);	// stay on the core of this camera
+		stage->start();
+		std::lock_guard<std::mutex> lock(stageRingMutex);
+		stageRing = &stage->getRing();
+		if(!started) {
+			// stopped before cleanup() could see the ring
+			stageRing->close();
+		}
+	}
 	Stopper timeInChange(-(Arguments::optStillChangeTime + 1) * 1000);		
 	// time spent in consecutive image change, initially big enough to accept the first still frame
 	while(keepAlive) {
@@ -155,17 +187,19 @@ void StillFilter::run() {
 		// we store some option variables because changing their value during the loop would mess it up
 		int optUseStaleFrame = Arguments::optUseStaleFrame;
 		int optStillSamplingPercent = Arguments::optStillSamplingPercent;
-		int optStillDownsampleExponent = Arguments::optStillDownsampleExponent;
+		int stillScale = stillDownsampling(Arguments::optStillDownsampleExponent, Arguments::optStillScale);
 		int optSharpTilesRequired = Arguments::optSharpTilesRequired;
 
 		// update capture properties if sampling percent was changed		
 		if(lastStillSamplingPercent != optStillSamplingPercent) {
-			updateCaptureProps(optStillSamplingPercent, optStillDownsampleExponent);
+			updateCaptureProps(optStillSamplingPercent, stillScale);
 			lastStillSamplingPercent = optStillSamplingPercent;
 		}
-		if(lastStillDownsampleExponent != optStillDownsampleExponent) {
-            updateCaptureProps(optStillSamplingPercent, optStillDownsampleExponent);
-            lastStillDownsampleExponent = optStillDownsampleExponent;
+		if(lastStillScale != stillScale) {
+            updateCaptureProps(optStillSamplingPercent, stillScale);
+            lastStillScale = stillScale;
+			fillRetrieveProps(stillProps[0], stillScale, true);
+			fillRetrieveProps(stillProps[1], stillScale, false);
 			if(smallFrameLast != NULL) { // invalidate the old one if any
 			   delete smallFrameLast;
 				smallFrameLast = NULL;
@@ -185,18 +219,68 @@ void StillFilter::run() {
 	
 		// Grab and retrieve frame if needed
 		
-		bool goOn = capture.grab() && cond;
-		DEB1("1 frame grabbed.");
-		if(goOn) {
+		bool goOn;
+		int elapsed;
+		// true if the big frame was retrieved together with the small one
+		bool bigRetrieved = false;
+		if(stage != NULL) {
+			FrameRing &ring = stage->getRing();
+			CapturedFrame *slot = waitFrame(ring);
+			DEB1("1 frame taken from ring.");
+			elapsed = timeInChange.elapsedMs();
+			goOn = slot != NULL && cond;
+			if(goOn) {
+				readArg->frameInfo = slot->frameInfo;
+				readArg->queueDelayUs = slot->queueDelayUs;
+				// take over the frames, the stage reallocates them
+				std::swap(*(readArg->frame), slot->big);
+				if(optStillSamplingPercent == 0) {
+					framep = readArg->frame;
+				}
+				else {
+					smallFrameCurr = new cv::Mat();
+					std::swap(*smallFrameCurr, slot->small);
+					framep = smallFrameCurr;
+					bigRetrieved = !(readArg->frame->empty());
+				}
+				DEB2("2 frame taken, queue delay us:", readArg->queueDelayUs);
+			}
+			if(slot != NULL) {
+				ring.release();
+			}
+		}
+		else {
+			goOn = capture.grab() && cond;
+			DEB1("1 frame grabbed.");
+			capture.getFrameInfo(readArg->frameInfo);
+			elapsed = timeInChange.elapsedMs();
+		}
+		if(readArg->frameInfo.dropped != lastDropped) {
+			DEB2("frames dropped:", readArg->frameInfo.dropped - lastDropped);
+			lastDropped = readArg->frameInfo.dropped;
+		}
+		if(goOn && stage == NULL) {
 			if(optStillSamplingPercent == 0) {
 				framep = readArg->frame;
+	            goOn = capture.retrieve(*framep, 0);
 			}
 			else {
 				smallFrameCurr = new cv::Mat();
 				framep = smallFrameCurr;
+				if(lastUnchanged && Arguments::optStillChangeTime <= elapsed) {
+					// the big frame will probably be needed, convert both in one pass
+					std::vector<cv::Mat> frames;
+					goOn = capture.retrieve(stillProps, frames);
+					*smallFrameCurr = frames[0];
+					*(readArg->frame) = frames[1];
+					bigRetrieved = goOn && !(readArg->frame->empty());
+				}
+				else {
+		            goOn = capture.retrieve(*framep, 0);
+				}
 			}
-            goOn = capture.retrieve(*framep, 0);
-			DEB1("2 frame retrieved.");
+			readArg->queueDelayUs = readArg->getAgeUs();
+			DEB2("2 frame retrieved, queue delay us:", readArg->queueDelayUs);
 		}
 		if(goOn) {
             goOn = !(framep->empty());
@@ -215,23 +299,36 @@ void StillFilter::run() {
 		// check for still images if retrieved and needed
 		
 		if(goOn && optStillSamplingPercent > 0) { 
+			if(smallFrameLast != NULL && smallFrameLast->size() != smallFrameCurr->size()) {
+				// captured before a downsampling change
+				delete smallFrameLast;
+				smallFrameLast = NULL;
+			}
 			bool changed = hasChanged(smallFrameCurr, smallFrameLast, optStillSamplingPercent);
-			int elapsed = timeInChange.elapsedMs();
+			lastUnchanged = !changed;
 			if(Arguments::optStillChangeTime > elapsed) {
 				goOn = false; // not enough yet
 			}
 			if(!changed) {
 				timeInChange.actualize();
-				if(goOn) {
+				if(goOn && bigRetrieved) {
+					DEB2("3 frame not changed, enough time spent in change, big frame already here", elapsed);
+				}
+				else if(goOn && stage != NULL) {
+					// the capture belongs to the stage, the big frame will come with a later still frame
+					DEB2("3 frame not changed, enough time spent in change, but no big frame", elapsed);
+					goOn = false;
+				}
+				else if(goOn) {
 					DEB2("3 frame not changed, enough time spent in change", elapsed);
 					// set downsampling
-					updateCaptureProps(0, optStillDownsampleExponent);
+					updateCaptureProps(0, stillScale);
 					goOn = capture.retrieve(*(readArg->frame), 0);
 					if(goOn) {
 						goOn = !(readArg->frame->empty());
 					}
 					// reset properties
-					updateCaptureProps(optStillSamplingPercent, optStillDownsampleExponent);
+					updateCaptureProps(optStillSamplingPercent, stillScale);
 					DEB1("4 big frame retrieved.");
 				}
 				else {
@@ -253,7 +350,8 @@ void StillFilter::run() {
 		// check sharpness if retrieved and needed
 		
 		if(goOn && optSharpTilesRequired > 0) {
-			readArg->tiles = checkSharpness(*(readArg->frame));
+			// the last small frame is from the same grab if the still check ran
+			readArg->tiles = checkSharpness(*(readArg->frame), optStillSamplingPercent > 0 ? smallFrameLast : NULL);
 			DEB2("5 sharpness ready, tiles:", readArg->tiles->size());
 			// are there enough sharp regions?
 			// started may have changed
@@ -308,6 +406,15 @@ void StillFilter::run() {
 			}
 		}
 	}
+	if(stage != NULL) {
+		{
+			std::lock_guard<std::mutex> lock(stageRingMutex);
+			stageRing = NULL;
+		}
+		stage->stop();
+		DEB2("ring overruns:", stage->getRing().getOverruns());
+		delete stage;
+	}
 	if(staleArg != NULL) {
 		delete staleArg;
 	}
@@ -319,52 +426,42 @@ void StillFilter::run() {
 	processor.stopMeasure();
 }
 
-void StillFilter::updateCaptureProps(int optStillSamplingPercent, int optStillDownsampleExponent) {
+CapturedFrame* StillFilter::waitFrame(FrameRing &ring) {
+	CapturedFrame *slot = ring.waitRead();
+	if(slot == NULL) {
+		// closed by cleanup(), the loop only runs until the processing finishes
+		std::chrono::milliseconds dura(1);
+		std::this_thread::sleep_for(dura);
+		return NULL;
+	}
+	if(Arguments::optDrainQueue) {
+		// keep only the newest one
+		while(ring.available() > 1) {
+			ring.release();
+			DEB1("skipped frame in ring.");
+		}
+		slot = ring.acquireRead();
+	}
+	return slot;
+}
+
+void StillFilter::updateCaptureProps(int optStillSamplingPercent, int stillScale) {
 	RetrieveProps props;
-    props.region.x = -1;    // use whole image
-    if(optStillSamplingPercent == 0) { // no check for still images
-    // we go direct for sharpness using YCrCb
-        props.sampling = DS_ORIGINAL;
-        props.colorspace = CS_YCRCB;
-    }
-    else {  // we check still images on a tiny resized image to eliminate
-        // camera shake
-        props.sampling = (RetrDownsample)optStillDownsampleExponent;
-        props.colorspace = CS_GRAY;
-    }
+	fillRetrieveProps(props, stillScale, optStillSamplingPercent != 0);
     capture.set(props);
 }
 
 bool StillFilter::hasChanged(const cv::Mat *current, const cv::Mat *last, int optStillSamplingPercent) {
-				std::chrono::milliseconds dura(100);
 	if(last == NULL || last->empty()) { // we discard the first frame
 		return true;
 	}
 	if(!current->isContinuous() || !last->isContinuous() || current->channels() != 1 || current->depth() != CV_8U || last->channels() != 1 || last->depth() != CV_8U) {
 		throw std::invalid_argument("StillFilter::hasChanged: both arguments are expected to be continuous and of same parameters.");
 	}
-    int len = current->cols * current->rows;
-	// number of pixels to examine
-	int n = len * optStillSamplingPercent / 100;
-	const char* cp = current->ptr<char>(0);
-	const char* lp = last->ptr<char>(0);
-	int rel = 0; // common relative index
-	int nDiff = 0;
-	for(int i = n; i > 0; i--) {
-		int diff = (int)(cp[rel]) - (int)(lp[rel]);
-		if(diff < 0) {
-			diff = -diff;
-		}
-		if(diff > Arguments::optStillNoiseThreshold) {
-			nDiff++;
-		}
-		// this increment is expected to be smaller than len
-		rel += Arguments::optStillSamplingInc;
-		while(rel > len) { // avoid division on ARM v6
-			rel -= len;
-		}
-	}
-	return nDiff * 100 > n * Arguments::optStillDeflectionPercent;
+	// number of pixels examined
+	int n;
+	return isStillChanged((StillEngine)Arguments::optStillEngine, (StillDecision)Arguments::optStillDecision, &sampleTable, current->ptr<unsigned char>(0), last->ptr<unsigned char>(0),
+			current->cols, current->rows, optStillSamplingPercent, Arguments::optStillNoiseThreshold, Arguments::optStillDeflectionPercent, n);
 }
 
 int StillFilter::dividor(int len, int div) {
@@ -381,91 +478,88 @@ int StillFilter::dividor(int len, int div) {
 	return ret;
 }
 
-std::set<SharpTile>* StillFilter::checkSharpness(const cv::Mat& frame) {
-	if(!frame.isContinuous() || frame.channels() != 3 || frame.depth() != CV_8U) {
+std::set<SharpTile>* StillFilter::checkSharpness(const cv::Mat& frame, const cv::Mat *small) {
+	// a single channel frame is planar 4:2:0 with the Y plane first
+	bool planar = frame.channels() == 1;
+	if(!frame.isContinuous() || (frame.channels() != 3 && !planar) || frame.depth() != CV_8U) {
         throw std::invalid_argument("StillFilter::checkSharpness: frame should be unsigned char encoded YCrCB with continuous storage.");
     }
 	// place to gather the sharp tiles
 	std::set<SharpTile> *sharp = new std::set<SharpTile>();
 	const unsigned char *image = frame.ptr();
-    int imageHeight = frame.rows;
+	// distance of horizontally adjacent Y samples
+	int step = planar ? 1 : 3;
+    int imageHeight = planar ? frame.rows * 2 / 3 : frame.rows;
 	int imageWidth = frame.cols;
-    int divHor = dividor(imageWidth, Arguments::optSharpTilesPerSide);
-    int divVert = dividor(imageHeight, Arguments::optSharpTilesPerSide);
-    int dividedWidth = imageWidth / divHor;
-    int dividedHeight = imageHeight / divVert;
-    int lastWidth = imageWidth - dividedWidth * (divHor - 1) - 1;
-    int lastHeight = imageHeight - dividedHeight * (divVert - 1) - 1;
-    int *lenHor = new int[divHor];
-	for(int i = divHor - 2; i >= 0; i--) {
-		lenHor[i] = dividedWidth;
+	TileGrid grid;
+	grid.width = imageWidth;
+	grid.height = imageHeight;
+    grid.cols = dividor(imageWidth, Arguments::optSharpTilesPerSide);
+    grid.rows = dividor(imageHeight, Arguments::optSharpTilesPerSide);
+    grid.tileWidth = imageWidth / grid.cols;
+    grid.tileHeight = imageHeight / grid.rows;
+    grid.lastWidth = imageWidth - grid.tileWidth * (grid.cols - 1) - 1;
+    grid.lastHeight = imageHeight - grid.tileHeight * (grid.rows - 1) - 1;
+	// reuse the tiles unchanged in the small frame since they were computed
+	bool useCache = Arguments::optSharpTileCache && small != NULL && !small->empty() && small->isContinuous() && small->channels() == 1;
+	if(useCache && !sharpReference.empty() && sharpReference.size() == small->size() && grid == sharpGrid &&
+			sharpDiffLow == Arguments::optSharpDiffLow && sharpDiffHigh == Arguments::optSharpDiffHigh) {
+		tileChanges(small->ptr(), sharpReference.ptr(), small->cols, small->rows, grid, Arguments::optStillNoiseThreshold, tileDirty);
 	}
-    lenHor[divHor - 1] = lastWidth;
-    int *lenVert = new int[divVert];
-	for(int i = divVert - 2; i >= 0; i--) {
-		lenVert[i] = dividedHeight;
+	else {
+		sharpGrid = grid;
+		sharpDiffLow = Arguments::optSharpDiffLow;
+		sharpDiffHigh = Arguments::optSharpDiffHigh;
+		tileDirty.assign(grid.cols * grid.rows, 1);
+		tileHighPercent.assign(grid.cols * grid.rows, -1);
+		sharpReference.release();
 	}
-    lenVert[divVert - 1] = lastHeight;
-	int lineLen = imageWidth * 3;
-    for(int fx = 0; fx < divHor; fx++) {
-        int thisWidth = lenHor[fx];
-        for(int fy = 0; fy < divVert; fy++) {
-            int thisHeight = lenVert[fy];
-			// number of horizontally or vertically adjacent samples exceeding lower limit
-            register int dVertL = 0, dHorL = 0;
-			// number of horizontally or vertically adjacent samples exceeding higher limit
-            register int dVertH = 0, dHorH = 0;
-			int startX = fx * dividedWidth;
-			int startY = fy * dividedHeight;
-			register int y = startY;
-			register const unsigned char *thisLine = image + lineLen * y + startX * 3;
-			int endy = startY + thisHeight;
-			for(; y < endy; y++) {
-				register int endx = startX + thisWidth;
-	            for(register int x = startX; x < endx; x++) {
-                    register int d = (int)(thisLine[lineLen]) - (int)(*thisLine);
-					if(d < 0) {
-						d = -d;
-					}
-                    if(d > Arguments::optSharpDiffLow) {
-                        dVertL++;
-                        if(d > Arguments::optSharpDiffHigh) {
-                            dVertH++;
-                        }
-                    }
-                    d = (int)(*thisLine);
-					thisLine += 3;
-					d -= (int)(*thisLine);
-					if(d < 0) {
-						d = -d;
-					}
-                    if(d > Arguments::optSharpDiffLow) {
-                        dHorL++;
-                        if(d > Arguments::optSharpDiffHigh) {
-                            dHorH++;
-                        }
-                    }
-				}
-				thisLine += lineLen - thisWidth * 3;
-            }
-			// if the ratio of lower/higher differences is small, there are likely to be edges
-			// yielding higher differences
-            int highPercentV = -1, highPercentH = -1;
-			// we need at least so many differences in one direction as the rectangle side length
-            if(dHorL >= dividedWidth) {
-				highPercentH = dHorH * 100 / dHorL;
-            }
-            if(dVertL >= dividedHeight) {
-				highPercentV = dVertH * 100 / dVertL;
-            }
-			int highPercent = highPercentH > highPercentV ? highPercentH : highPercentV;
+	// counts of the vertical and horizontal differences over the lower and the higher limit
+	sharpTileCounts(image, step, grid, Arguments::optSharpDiffLow, Arguments::optSharpDiffHigh, tileDirty, sharpCounts);
+    for(int fx = 0; fx < grid.cols; fx++) {
+        for(int fy = 0; fy < grid.rows; fy++) {
+			int startX, startY, thisWidth, thisHeight;
+			grid.tile(fx, fy, startX, startY, thisWidth, thisHeight);
+			int tile = fy * grid.cols + fx;
+			if(tileDirty[tile]) {
+				const int *counts = &sharpCounts[4 * tile];
+				int dVertL = counts[0], dVertH = counts[1], dHorL = counts[2], dHorH = counts[3];
+				// if the ratio of lower/higher differences is small, there are likely to be edges
+				// yielding higher differences
+                int highPercentV = -1, highPercentH = -1;
+				// we need at least so many differences in one direction as the rectangle side length
+                if(dHorL >= grid.tileWidth) {
+					highPercentH = dHorH * 100 / dHorL;
+                }
+                if(dVertL >= grid.tileHeight) {
+					highPercentV = dVertH * 100 / dVertL;
+                }
+				tileHighPercent[tile] = highPercentH > highPercentV ? highPercentH : highPercentV;
+			}
+			int highPercent = tileHighPercent[tile];
             if(highPercent > Arguments::optSharpHighPercent) {
 				sharp->insert(SharpTile(highPercent, thisWidth, thisHeight, startX, startY));
             }
 		}
 	}
 
-	delete[] lenHor;
-	delete[] lenVert;
+	// remember how the recomputed tiles looked
+	if(!useCache) {
+		sharpReference.release();
+	}
+	else if(sharpReference.empty()) {
+		small->copyTo(sharpReference);
+	}
+	else {
+		for(int tile = 0; tile < grid.cols * grid.rows; tile++) {
+			if(tileDirty[tile]) {
+				int x0, y0, x1, y1;
+				tileArea(grid, tile % grid.cols, tile / grid.cols, small->cols, small->rows, false, x0, y0, x1, y1);
+				for(int y = y0; y < y1; y++) {
+					memcpy(sharpReference.ptr(y) + x0, small->ptr(y) + x0, x1 - x0);
+				}
+			}
+		}
+	}
 	return sharp;
 }
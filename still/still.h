@@ -9,12 +9,15 @@ Copyleft Balázs Bámer, 2015.
 
 #include<thread>
 #include<set>
+#include<string>
 #include<opencv2/core.hpp>
 
 #include"opencv2/videoio_mod.hpp"
 #include"still_config.h"
 #include"util.h"
 #include"measure.h"
+#include"capture.h"
+#include"stillcheck.h"
 
 #if USE_NVWA == 1
 #include"debug_new.h"
@@ -91,13 +94,23 @@ namespace projector {
 		Stopper timestamp; 
 
 		/**
-		The frame itself. It is assumed to be full-size and have YCrCb color format in unsigned 8 bit depth. */
+		The frame itself. It is assumed to be full-size and have interleaved YCrCb color format in unsigned 8 bit depth, or planar 4:2:0 as a single channel if optPlanarFrames is set. */
 		cv::Mat *frame;
 
 		/**
 		Contains the sharp tiles if sharpness has been checked in StillFilter, otherwise NULL.
 		*/
 		std::set<SharpTile> *tiles;
+
+		/**
+		Driver timestamp, sequence number and dropped frame count of the grabbed frame.
+		*/
+		FrameInfo frameInfo;
+
+		/**
+		Time in microseconds from the driver timestamp to the retrieval, -1 if unknown.
+		*/
+		long queueDelayUs;
 		
 		/**
 		Initializes the instance with an empty frames and NULL tiles.
@@ -107,6 +120,10 @@ namespace projector {
 			frame = new cv::Mat();
 			// but get the tiles from outside
 			tiles = NULL;
+			frameInfo.timestampUs = 0;
+			frameInfo.sequence = 0;
+			frameInfo.dropped = 0;
+			queueDelayUs = -1;
 		};
 
 		/**
@@ -120,6 +137,28 @@ namespace projector {
 				delete tiles;
 			}
 		};
+
+	public:
+		/**
+		Returns the driver-side information of the frame.
+		*/
+		const FrameInfo& getFrameInfo() const {
+			return frameInfo;
+		}
+
+		/**
+		Returns the time in microseconds the frame spent between the driver and the retrieval, -1 if unknown.
+		*/
+		long getQueueDelayUs() const {
+			return queueDelayUs;
+		}
+
+		/**
+		Returns the time in microseconds elapsed since the driver captured the frame, -1 if unknown.
+		*/
+		long getAgeUs() const {
+			return frameAgeUs(frameInfo);
+		}
 	};
 
 	/**
@@ -147,12 +186,17 @@ namespace projector {
 		*/
 		PollSensors measure;
 
+		/**
+		Inserted after OUTPUT_FILE_PREFIX in the names of the saved files to tell the cameras apart.
+		*/
+		std::string fileTag;
+
 		DEBDEC;
 	public:
 		/**
 		Sets the debug prefix if needed and the current status to no image.
 		*/
-		FrameProcessor();
+		FrameProcessor(const std::string &tag = std::string());
 
 		/**
 		Joins the processing thread if any.
@@ -219,6 +263,51 @@ namespace projector {
 		The initialized frame processor instance to use.
 		*/
 		FrameProcessor& processor;
+
+		/**
+		Sample positions of the sampled still check engine.
+		*/
+		SampleTable sampleTable;
+
+		/**
+		Small still check frame as it was at the sharpness check, the area of each tile is updated when the tile is recomputed.
+		*/
+		cv::Mat sharpReference;
+
+		/**
+		Tile grid of the last sharpness check.
+		*/
+		TileGrid sharpGrid;
+
+		/**
+		Sharpness difference limits of the last check, the cached tiles are invalid if they change.
+		*/
+		int sharpDiffLow, sharpDiffHigh;
+
+		/**
+		Cached ratio of high to low differences of each tile in percent, -1 if there were too few differences.
+		*/
+		std::vector<int> tileHighPercent;
+
+		/**
+		Change map of the tiles since their last computation.
+		*/
+		std::vector<unsigned char> tileDirty;
+
+		/**
+		Difference counts of the tiles in the last sharpness check.
+		*/
+		std::vector<int> sharpCounts;
+
+		/**
+		Ring of the running capture stage, NULL if there is none. cleanup() closes it to wake run().
+		*/
+		FrameRing *stageRing;
+
+		/**
+		Guards stageRing between run() and cleanup().
+		*/
+		std::mutex stageRingMutex;
 	public:
 		/**
 		Constructs a new filter without starting it. Just sets the two arguments.
@@ -227,9 +316,14 @@ namespace projector {
 	
 	protected:
 		/**
-		Updates capture settings according to the passed still sampling percent value. Needs to get saved values instead of accessing Arguments::opt... because these may change runtime and this method is used more times.
+		Updates capture settings according to the passed still sampling percent value and still check downsampling factor. Needs to get saved values instead of accessing Arguments::opt... because these may change runtime and this method is used more times.
+		*/
+		void updateCaptureProps(int optStillSamplingPercent, int stillScale);
+
+		/**
+		Waits for a frame in the ring of the capture stage, sleeping until one is published. If Arguments::optDrainQueue is set, older frames are skipped. Returns NULL if stopped meanwhile.
 		*/
-		void updateCaptureProps(int optStillSamplingPercent, int optStillDownsampleExponent);
+		CapturedFrame* waitFrame(FrameRing &ring);
 
 		/**
 		Checks if the two images are different enough. See README.md for more details.
@@ -244,9 +338,12 @@ namespace projector {
 
 		/**
 		Checks if this image is sharp enough. This implementation considers
-		only YCrCb Images and their Y channel. See README.md for more details.
+		only the Y channel of interleaved or planar 4:2:0 YCrCb images. If
+		small is the still check frame of the same grab, tiles not changed in
+		it since their last computation are taken from the cache. See
+		README.md for more details.
 		*/
-		virtual std::set<SharpTile>* checkSharpness(const cv::Mat& frame);
+		virtual std::set<SharpTile>* checkSharpness(const cv::Mat& frame, const cv::Mat *small);
 		
 		/**
 		Does the actual filtering in separate thread. See README.md for more details.
@@ -0,0 +1,492 @@
+#include<chrono>
+#include<iostream>
+#include<vector>
+#include<random>
+#include<math.h>
+#include<algorithm>
+
+#include"stillcheck.h"
+
+#if USE_SIMD == 1 && defined(__GNUC__) && defined(__SSE2__)
+#define STILLCHECK_SIMD_X86
+#include<emmintrin.h>
+#elif USE_SIMD == 1 && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define STILLCHECK_SIMD_NEON
+#include<arm_neon.h>
+#endif
+
+#if USE_NVWA == 1
+#include"debug_new.h"
+#endif
+
+
+using namespace projector;
+
+// Returns the greatest common divisor of a and b.
+static int gcd(int a, int b) {
+	while(b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+int projector::coprimeIncrement(int len, int inc) {
+	if(len <= 1) {
+		return inc;
+	}
+	while(gcd(len, inc) != 1) {
+		inc++;
+	}
+	return inc;
+}
+
+void SampleTable::update(int l, int i, int n) {
+	if(l == len && i == inc && n == (int)index.size()) {
+		return;
+	}
+	len = l;
+	inc = i;
+	usedInc = coprimeIncrement(len, inc);
+	index.resize(n);
+	int rel = 0;
+	for(int k = 0; k < n; k++) {
+		index[k] = rel;
+		rel += usedInc;
+		while(rel >= len) {
+			rel -= len;
+		}
+	}
+	std::sort(index.begin(), index.end());
+}
+
+StillDecider::StillDecider(StillDecision d, long t, int defl, int alpha, int beta, int margin) : decision(d), total(t), deflection(defl), examined(0), diffs(0), slope(0.0), changedBase(0.0), stillBase(0.0) {
+	if(decision != STILL_DECISION_SPRT) {
+		return;
+	}
+	// H0: the ratio of differing pixels is p0 below the deflection, H1: it is p1 above
+	double p0 = deflection * (100 - margin) / 10000.0;
+	double p1 = deflection * (100 + margin) / 10000.0;
+	if(p1 > 0.999) {
+		p1 = 0.999;
+	}
+	if(p0 <= 0.0) { // any difference means change, nothing to test
+		decision = STILL_DECISION_EARLY;
+		return;
+	}
+	double a = log(p1 / p0);	// log likelihood ratio of a differing pixel
+	double b = log((1.0 - p1) / (1.0 - p0));	// and of a same one
+	slope = -b / (a - b);
+	changedBase = log((1000.0 - beta) / alpha) / (a - b);
+	stillBase = log(beta / (1000.0 - alpha)) / (a - b);
+}
+
+int StillDecider::add(long newExamined, long newDiffs) {
+	examined += newExamined;
+	diffs += newDiffs;
+	if(decision == STILL_DECISION_COUNT) {
+		return -1;
+	}
+	// bounds holding whatever the rest of the pixels are
+	if(diffs * 100 > total * deflection) {
+		return 1;
+	}
+	if((diffs + total - examined) * 100 <= total * deflection) {
+		return 0;
+	}
+	if(decision == STILL_DECISION_SPRT) {
+		if(diffs >= changedBase + slope * examined) {
+			return 1;
+		}
+		if(diffs <= stillBase + slope * examined) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Counts the differences among n samples starting at rel, and leaves rel at the next sample.
+static int sampledRun(const unsigned char *current, const unsigned char *last, int len, int n, int inc, int threshold, int &rel) {
+	int nDiff = 0;
+	for(int i = n; i > 0; i--) {
+		int diff = (int)(current[rel]) - (int)(last[rel]);
+		if(diff < 0) {
+			diff = -diff;
+		}
+		if(diff > threshold) {
+			nDiff++;
+		}
+		// this increment is expected to be smaller than len
+		rel += inc;
+		while(rel >= len) { // avoid division on ARM v6
+			rel -= len;
+		}
+	}
+	return nDiff;
+}
+
+int projector::countSampledDiffs(const unsigned char *current, const unsigned char *last, int len, int n, int inc, int threshold) {
+	int rel = 0; // common relative index
+	return sampledRun(current, last, len, n, coprimeIncrement(len, inc), threshold, rel);
+}
+
+// Counts the differences at the n positions taken by step from index.
+static int tableRun(const unsigned char *current, const unsigned char *last, const int *index, int n, int step, int threshold) {
+	int nDiff = 0;
+	for(int i = 0; i < n; i++, index += step) {
+		int diff = (int)(current[*index]) - (int)(last[*index]);
+		nDiff += (diff > threshold) | (-diff > threshold);
+	}
+	return nDiff;
+}
+
+// Returns the number of rows the strips engine compares.
+static int stripRowCount(int height, int percent) {
+	int rows = (height * percent + 99) / 100;
+	return rows > height ? height : rows;
+}
+
+// Gives the first row and the row count of strip s of at most 8 rows, centered in its own band of the frame.
+static void stripAt(int s, int strips, int height, int rows, int &top, int &count) {
+	int bandTop = height * s / strips;
+	int band = height * (s + 1) / strips - bandTop;
+	count = rows * (s + 1) / strips - rows * s / strips;
+	if(count > band) {
+		count = band;
+	}
+	top = bandTop + (band - count) / 2;
+}
+
+// Returns a step relative prime to strips near its golden section, so that visiting the strips by it spreads them over the frame.
+static int spreadStep(int strips) {
+	return coprimeIncrement(strips, (int)(strips * 0.618) | 1);
+}
+
+int projector::countDiffs(const unsigned char *current, const unsigned char *last, int len, int threshold) {
+	int nDiff = 0;
+	int i = 0;
+	if(threshold < 255) {
+#if defined(STILLCHECK_SIMD_X86)
+		const __m128i thr = _mm_set1_epi8((char)threshold);
+		const __m128i zero = _mm_setzero_si128();
+		for(; i + 16 <= len; i += 16) {
+			__m128i c = _mm_loadu_si128((const __m128i*)(current + i));
+			__m128i l = _mm_loadu_si128((const __m128i*)(last + i));
+			__m128i ad = _mm_or_si128(_mm_subs_epu8(c, l), _mm_subs_epu8(l, c));
+			// nonzero where |c - l| > threshold
+			__m128i over = _mm_subs_epu8(ad, thr);
+			int same = _mm_movemask_epi8(_mm_cmpeq_epi8(over, zero));
+			nDiff += 16 - __builtin_popcount(same);
+		}
+#elif defined(STILLCHECK_SIMD_NEON)
+		const uint8x16_t thr = vdupq_n_u8((uint8_t)threshold);
+		const uint8x16_t one = vdupq_n_u8(1);
+		while(i + 16 <= len) {
+			// the 8-bit counters may take 255 blocks before flushing
+			int end = i + 255 * 16;
+			if(end > len) {
+				end = len;
+			}
+			uint8x16_t acc = vdupq_n_u8(0);
+			for(; i + 16 <= end; i += 16) {
+				uint8x16_t ad = vabdq_u8(vld1q_u8(current + i), vld1q_u8(last + i));
+				acc = vaddq_u8(acc, vandq_u8(vcgtq_u8(ad, thr), one));
+			}
+			uint16x8_t s16 = vpaddlq_u8(acc);
+			uint32x4_t s32 = vpaddlq_u16(s16);
+			uint64x2_t s64 = vpaddlq_u32(s32);
+			nDiff += (int)(vgetq_lane_u64(s64, 0) + vgetq_lane_u64(s64, 1));
+		}
+#endif
+	}
+	for(; i < len; i++) {
+		int diff = (int)(current[i]) - (int)(last[i]);
+		if(diff < 0) {
+			diff = -diff;
+		}
+		if(diff > threshold) {
+			nDiff++;
+		}
+	}
+	return nDiff;
+}
+
+int projector::countStillDiffs(StillEngine engine, SampleTable *table, const unsigned char *current, const unsigned char *last, int width, int height, int percent, int threshold, int &examined) {
+	int len = width * height;
+	int nDiff = 0;
+	switch(engine) {
+	case STILL_ENGINE_STRIPS: {
+		int rows = stripRowCount(height, percent);
+		int strips = (rows + 7) / 8;
+		examined = 0;
+		for(int s = 0; s < strips; s++) {
+			int top, count;
+			stripAt(s, strips, height, rows, top, count);
+			int offset = top * width;
+			nDiff += countDiffs(current + offset, last + offset, count * width, threshold);
+			examined += count * width;
+		}
+		break;
+	}
+	case STILL_ENGINE_FULL:
+		nDiff = countDiffs(current, last, len, threshold);
+		examined = len;
+		break;
+	default:
+		examined = len * percent / 100;
+		if(table != NULL) {
+			table->update(len, Arguments::optStillSamplingInc, examined);
+			nDiff = tableRun(current, last, table->data(), examined, 1, threshold);
+		}
+		else {
+			nDiff = countSampledDiffs(current, last, len, examined, Arguments::optStillSamplingInc, threshold);
+		}
+		break;
+	}
+	return nDiff;
+}
+
+bool projector::isStillChanged(StillEngine engine, StillDecision decision, SampleTable *table, const unsigned char *current, const unsigned char *last, int width, int height, int percent, int threshold, int deflection, int &examined) {
+	if(decision == STILL_DECISION_COUNT) {
+		int nDiff = countStillDiffs(engine, table, current, last, width, height, percent, threshold, examined);
+		return (long)nDiff * 100 > (long)examined * deflection;
+	}
+	int len = width * height;
+	int result = -1;
+	if(engine != STILL_ENGINE_STRIPS && engine != STILL_ENGINE_FULL) {
+		int n = len * percent / 100;
+		StillDecider decider(decision, n, deflection, Arguments::optStillSprtAlpha, Arguments::optStillSprtBeta, Arguments::optStillSprtMargin);
+		if(table != NULL) {
+			// block j takes every blocks-th position from the j-th, spreading over the frame
+			table->update(len, Arguments::optStillSamplingInc, n);
+			int blocks = (n + STILL_DECISION_BLOCK - 1) / STILL_DECISION_BLOCK;
+			for(int j = 0; result < 0 && j < blocks; j++) {
+				int block = (n - j + blocks - 1) / blocks;
+				result = decider.add(block, tableRun(current, last, table->data() + j, block, blocks, threshold));
+			}
+		}
+		else {
+			int rel = 0;
+			int inc = coprimeIncrement(len, Arguments::optStillSamplingInc);
+			for(int done = 0; result < 0 && done < n; done += STILL_DECISION_BLOCK) {
+				int block = n - done < STILL_DECISION_BLOCK ? n - done : STILL_DECISION_BLOCK;
+				result = decider.add(block, sampledRun(current, last, len, block, inc, threshold, rel));
+			}
+		}
+		examined = decider.getExamined();
+		return result < 0 ? decider.changed() : result == 1;
+	}
+	// the full frame is handled as strips covering all rows, visited spread over the frame
+	int rows = engine == STILL_ENGINE_FULL ? height : stripRowCount(height, percent);
+	int strips = (rows + 7) / 8;
+	long total = 0;
+	for(int s = 0; s < strips; s++) {
+		int top, count;
+		stripAt(s, strips, height, rows, top, count);
+		total += count * width;
+	}
+	StillDecider decider(decision, total, deflection, Arguments::optStillSprtAlpha, Arguments::optStillSprtBeta, Arguments::optStillSprtMargin);
+	int step = strips > 0 ? spreadStep(strips) : 1;
+	for(int j = 0, s = 0; result < 0 && j < strips; j++) {
+		int top, count;
+		stripAt(s, strips, height, rows, top, count);
+		int offset = top * width;
+		result = decider.add(count * width, countDiffs(current + offset, last + offset, count * width, threshold));
+		s += step;
+		if(s >= strips) {
+			s -= strips;
+		}
+	}
+	examined = decider.getExamined();
+	return result < 0 ? decider.changed() : result == 1;
+}
+
+void projector::tileArea(const TileGrid &grid, int fx, int fy, int width, int height, bool extended, int &x0, int &y0, int &x1, int &y1) {
+	int x, y, w, h;
+	grid.tile(fx, fy, x, y, w, h);
+	x0 = x * width / grid.width;
+	y0 = y * height / grid.height;
+	if(extended) {
+		// the sharpness check reads one more column and row, the downsampling may floor the small size
+		x1 = ((x + w + 1) * width + grid.width - 1) / grid.width + 1;
+		y1 = ((y + h + 1) * height + grid.height - 1) / grid.height + 1;
+	}
+	else {
+		x1 = fx == grid.cols - 1 ? width : (x + w) * width / grid.width;
+		y1 = fy == grid.rows - 1 ? height : (y + h) * height / grid.height;
+	}
+	x1 = x1 > width ? width : x1;
+	y1 = y1 > height ? height : y1;
+}
+
+int projector::tileChanges(const unsigned char *current, const unsigned char *reference, int width, int height, const TileGrid &grid, int threshold, std::vector<unsigned char> &dirty) {
+	int changed = 0;
+	dirty.assign(grid.cols * grid.rows, 0);
+	for(int fy = 0; fy < grid.rows; fy++) {
+		for(int fx = 0; fx < grid.cols; fx++) {
+			int x0, y0, x1, y1;
+			tileArea(grid, fx, fy, width, height, true, x0, y0, x1, y1);
+			for(int y = y0; y < y1; y++) {
+				int offset = y * width + x0;
+				if(countDiffs(current + offset, reference + offset, x1 - x0, threshold) > 0) {
+					dirty[fy * grid.cols + fx] = 1;
+					changed++;
+					break;
+				}
+			}
+		}
+	}
+	return changed;
+}
+
+void projector::countDiffsOver(const unsigned char *a, const unsigned char *b, int len, int low, int high, int &overLow, int &overHigh) {
+	// a difference is counted over high only if it is over low as well
+	high = high > low ? high : low;
+	low = low < 0 ? 0 : low > 255 ? 255 : low;
+	high = high > 255 ? 255 : high;
+	int i = 0;
+#if defined(STILLCHECK_SIMD_X86)
+	const __m128i lowv = _mm_set1_epi8((char)low);
+	const __m128i highv = _mm_set1_epi8((char)high);
+	const __m128i zero = _mm_setzero_si128();
+	for(; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i l = _mm_loadu_si128((const __m128i*)(b + i));
+		__m128i ad = _mm_or_si128(_mm_subs_epu8(c, l), _mm_subs_epu8(l, c));
+		overLow += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(ad, lowv), zero)));
+		overHigh += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(ad, highv), zero)));
+	}
+#elif defined(STILLCHECK_SIMD_NEON)
+	const uint8x16_t lowv = vdupq_n_u8((uint8_t)low);
+	const uint8x16_t highv = vdupq_n_u8((uint8_t)high);
+	while(i + 16 <= len) {
+		// the 8-bit counters may take 255 blocks before flushing
+		int end = i + 255 * 16;
+		if(end > len) {
+			end = len;
+		}
+		uint8x16_t accLow = vdupq_n_u8(0);
+		uint8x16_t accHigh = vdupq_n_u8(0);
+		for(; i + 16 <= end; i += 16) {
+			uint8x16_t ad = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+			// the all-ones mask is -1
+			accLow = vsubq_u8(accLow, vcgtq_u8(ad, lowv));
+			accHigh = vsubq_u8(accHigh, vcgtq_u8(ad, highv));
+		}
+		uint64x2_t sumLow = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(accLow)));
+		uint64x2_t sumHigh = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(accHigh)));
+		overLow += (int)(vgetq_lane_u64(sumLow, 0) + vgetq_lane_u64(sumLow, 1));
+		overHigh += (int)(vgetq_lane_u64(sumHigh, 0) + vgetq_lane_u64(sumHigh, 1));
+	}
+#endif
+	for(; i < len; i++) {
+		int d = (int)(a[i]) - (int)(b[i]);
+		if(d < 0) {
+			d = -d;
+		}
+		overLow += d > low;
+		overHigh += d > high;
+	}
+}
+
+// Copies the Y samples of an interleaved row to a contiguous one.
+static void gatherRow(const unsigned char *src, int step, int width, unsigned char *dst) {
+	for(int i = 0; i < width; i++, src += step) {
+		dst[i] = *src;
+	}
+}
+
+void projector::sharpTileCounts(const unsigned char *image, int step, const TileGrid &grid, int low, int high, const std::vector<unsigned char> &dirty, std::vector<int> &counts) {
+	counts.assign(grid.cols * grid.rows * 4, 0);
+	int lineLen = grid.width * step;
+	// interleaved rows are gathered once each into contiguous ones
+	std::vector<unsigned char> rows(step == 1 ? 0 : 2 * grid.width);
+	unsigned char *cur = rows.data(), *next = cur + grid.width;
+	for(int fy = 0; fy < grid.rows; fy++) {
+		bool any = false;
+		for(int fx = 0; fx < grid.cols; fx++) {
+			any = any || dirty[fy * grid.cols + fx];
+		}
+		if(!any) {
+			continue;
+		}
+		int x, top, w, height;
+		grid.tile(0, fy, x, top, w, height);
+		if(step != 1) {
+			gatherRow(image + lineLen * top, step, grid.width, cur);
+		}
+		// the last row of the band reads the first row of the next one
+		for(int r = top; r < top + height; r++) {
+			const unsigned char *thisLine, *nextLine;
+			if(step == 1) {
+				thisLine = image + lineLen * r;
+				nextLine = thisLine + lineLen;
+			}
+			else {
+				gatherRow(image + lineLen * (r + 1), step, grid.width, next);
+				thisLine = cur;
+				nextLine = next;
+			}
+			for(int fx = 0; fx < grid.cols; fx++) {
+				int tile = fy * grid.cols + fx;
+				if(dirty[tile]) {
+					int y, h;
+					grid.tile(fx, fy, x, y, w, h);
+					int *c = &counts[4 * tile];
+					countDiffsOver(thisLine + x, nextLine + x, w, low, high, c[0], c[1]);
+					countDiffsOver(thisLine + x, thisLine + x + 1, w, low, high, c[2], c[3]);
+				}
+			}
+			std::swap(cur, next);
+		}
+	}
+}
+
+void projector::benchmarkStillCheck(int scale) {
+	static const int sizes[][2] = {{640, 480}, {1280, 720}};
+	// the sampled engine is timed both with and without its index table
+	static const StillEngine engines[] = {STILL_ENGINE_SAMPLED, STILL_ENGINE_SAMPLED, STILL_ENGINE_STRIPS, STILL_ENGINE_FULL};
+	static const char *engineNames[] = {"sampled", "sampled+table", "strips", "full"};
+	static const char *decisionNames[] = {"count", "early", "sprt"};
+	static const char *sceneNames[] = {"moving", "still"};
+	int threshold = Arguments::optStillNoiseThreshold;
+	int percent = Arguments::optStillSamplingPercent;
+	int deflection = Arguments::optStillDeflectionPercent;
+	std::mt19937 gen(1);
+	for(unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int width = sizes[s][0] / scale;
+		int height = sizes[s][1] / scale;
+		int len = width * height;
+		if(len == 0) {
+			continue;
+		}
+		// about 20 million pixels for each engine in full frame terms
+		int repeat = 1 + 20000000 / (len + 1);
+		std::cout << "still check " << width << 'x' << height << ", " << repeat << " runs:\n";
+		std::vector<unsigned char> current(len), last(len);
+		for(int scene = 0; scene < 2; scene++) {
+			// a moving scene has about half of the pixels over the noise threshold, a still one none
+			int amplitude = scene == 0 ? 2 * threshold : threshold;
+			std::uniform_int_distribution<int> noise(-amplitude, amplitude);
+			for(int i = 0; i < len; i++) {
+				last[i] = (unsigned char)gen();
+				int v = last[i] + noise(gen);
+				current[i] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+			}
+			for(unsigned int e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+				SampleTable table;
+				for(int d = STILL_DECISION_COUNT; d <= STILL_DECISION_SPRT; d++) {
+					int examined = 0;
+					bool changed = false;
+					std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+					for(int r = 0; r < repeat; r++) {
+						changed = isStillChanged(engines[e], (StillDecision)d, e == 1 ? &table : NULL, current.data(), last.data(), width, height, percent, threshold, deflection, examined);
+					}
+					double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / repeat;
+					std::cout << "  " << sceneNames[scene] << ' ' << engineNames[e] << ' ' << decisionNames[d] << ": " << us << " us, " << examined << " pixels examined, " << (changed ? "changed" : "still") << '\n';
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,285 @@
+/** @file
+Engines of the still scene check, counting the pixels of the small frame
+that differ from the last one, and a benchmark comparing them.
+
+Copyleft Balázs Bámer, 2015.
+*/
+
+#ifndef PROJECTOR_STILLCHECK_H
+#define PROJECTOR_STILLCHECK_H
+
+#include<vector>
+
+#include"still_config.h"
+
+#if USE_NVWA == 1
+#include"debug_new.h"
+#endif
+
+
+/**
+Number of samples or pixels between two looks at the still decision.
+*/
+#define STILL_DECISION_BLOCK 256
+
+namespace projector {
+
+	/**
+	Still check engines selectable by optStillEngine.
+	*/
+	enum StillEngine {
+		/** Samples optStillSamplingPercent of the pixels with optStillSamplingInc increment. */
+		STILL_ENGINE_SAMPLED,
+
+		/** Compares optStillSamplingPercent of the rows as contiguous strips spread evenly over the frame. */
+		STILL_ENGINE_STRIPS,
+
+		/** Compares every pixel. */
+		STILL_ENGINE_FULL
+	};
+
+	/**
+	Ways to decide if the scene has changed, selectable by optStillDecision.
+	*/
+	enum StillDecision {
+		/** Counts all examined pixels, then compares the ratio of differing ones to optStillDeflectionPercent. */
+		STILL_DECISION_COUNT,
+
+		/** As STILL_DECISION_COUNT, but stops as soon as the result can not change any more. */
+		STILL_DECISION_EARLY,
+
+		/** Sequential probability ratio test with optStillSprtAlpha and optStillSprtBeta error bounds, falling back to STILL_DECISION_EARLY. */
+		STILL_DECISION_SPRT
+	};
+
+	/**
+	Collects the differing pixel counts of the still check piece by piece and
+	tells when the decision about the change is known. The pixels must be fed
+	in an order spreading them over the frame for the SPRT to be meaningful.
+	*/
+	class StillDecider {
+	protected:
+		/**
+		The decision mode.
+		*/
+		StillDecision decision;
+
+		/**
+		Number of pixels to examine in total.
+		*/
+		long total;
+
+		/**
+		Allowed deflection percentage of differing pixels.
+		*/
+		int deflection;
+
+		/**
+		Number of pixels examined so far.
+		*/
+		long examined;
+
+		/**
+		Number of differing pixels so far.
+		*/
+		long diffs;
+
+		/**
+		The SPRT accepts change if diffs >= changedBase + slope * examined,
+		and stillness if diffs <= stillBase + slope * examined.
+		*/
+		double slope;
+
+		/**
+		Intercept of the change acceptance line.
+		*/
+		double changedBase;
+
+		/**
+		Intercept of the stillness acceptance line.
+		*/
+		double stillBase;
+
+	public:
+		/**
+		Prepares deciding on total pixels, with the error bounds alpha and beta of the SPRT in per mille, for false change and false stillness, respectively, and the margin of the SPRT in percent of the deflection.
+		*/
+		StillDecider(StillDecision decision, long total, int deflection, int alpha, int beta, int margin);
+
+		/**
+		Adds the count of differing pixels among the newly examined ones and returns 1 if the scene has surely changed, 0 if it surely has not, -1 if more pixels are needed.
+		*/
+		int add(long newExamined, long newDiffs);
+
+		/**
+		Returns the decision on all pixels examined so far.
+		*/
+		bool changed() const {
+			return diffs * 100 > total * deflection;
+		}
+
+		/**
+		Returns the number of pixels examined so far.
+		*/
+		long getExamined() const {
+			return examined;
+		}
+	};
+
+	/**
+	Returns inc if it is relative prime to len, otherwise the next larger
+	increment that is, so that sampling by it never revisits a pixel.
+	*/
+	int coprimeIncrement(int len, int inc);
+
+	/**
+	Positions of the still check samples taken by the increment, rebuilt
+	only when the frame length, the increment or the sample count changes.
+	The positions are sorted, so counting walks the frame sequentially. The
+	early decisions read the table in blocks of at most STILL_DECISION_BLOCK
+	positions, each taking every m-th one to spread over the whole frame,
+	because a small increment taken in order covers only the top rows.
+	*/
+	class SampleTable {
+	protected:
+		/**
+		The sample positions.
+		*/
+		std::vector<int> index;
+
+		/**
+		Frame length the table was built for, -1 if not built yet.
+		*/
+		int len;
+
+		/**
+		Increment requested when the table was built.
+		*/
+		int inc;
+
+		/**
+		Increment actually used, relative prime to len.
+		*/
+		int usedInc;
+
+	public:
+		/**
+		Creates an empty table to be built at the first update.
+		*/
+		SampleTable() : len(-1), inc(0), usedInc(0) {};
+
+		/**
+		Rebuilds the table for n samples taken by increment inc from a frame of len pixels unless it is already built for these.
+		*/
+		void update(int len, int inc, int n);
+
+		/**
+		Returns the sample positions.
+		*/
+		const int* data() const {
+			return index.data();
+		}
+
+		/**
+		Returns the number of samples.
+		*/
+		int size() const {
+			return (int)index.size();
+		}
+
+		/**
+		Returns the increment actually used.
+		*/
+		int getIncrement() const {
+			return usedInc;
+		}
+	};
+
+	/**
+	Returns the number of pixels among n ones taken by the increment inc made relative prime to len, wrapping around, from the len long current and last differing more than threshold.
+	*/
+	int countSampledDiffs(const unsigned char *current, const unsigned char *last, int len, int n, int inc, int threshold);
+
+	/**
+	Returns the number of pixels among the len long current and last differing more than threshold, using SSE2 or NEON if enabled by USE_SIMD.
+	*/
+	int countDiffs(const unsigned char *current, const unsigned char *last, int len, int threshold);
+
+	/**
+	Compares the width x height frames current and last with the engine, and returns the number of pixels differing more than threshold in examined, and the number of pixels examined for the given percent. The sampled engine reads the positions from table if not NULL, updating it as needed.
+	*/
+	int countStillDiffs(StillEngine engine, SampleTable *table, const unsigned char *current, const unsigned char *last, int width, int height, int percent, int threshold, int &examined);
+
+	/**
+	Compares the width x height frames current and last with the engine, and returns true if more than deflection percent of the examined pixels differ more than threshold. Stops as early as the decision allows, and puts the number of pixels actually examined in examined. The sampled engine reads the positions from table if not NULL, updating it as needed.
+	*/
+	bool isStillChanged(StillEngine engine, StillDecision decision, SampleTable *table, const unsigned char *current, const unsigned char *last, int width, int height, int percent, int threshold, int deflection, int &examined);
+
+	/**
+	Geometry of the sharpness tiles over the Y plane of the full-size frame.
+	*/
+	struct TileGrid {
+		/** Width of the Y plane. */
+		int width;
+		/** Height of the Y plane. */
+		int height;
+		/** Number of tiles horizontally. */
+		int cols;
+		/** Number of tiles vertically. */
+		int rows;
+		/** Width of all but the last tile in a row. */
+		int tileWidth;
+		/** Height of all but the last tile in a column. */
+		int tileHeight;
+		/** Width of the last tile in a row, leaving the last column for the differences. */
+		int lastWidth;
+		/** Height of the last tile in a column, leaving the last row for the differences. */
+		int lastHeight;
+
+		/**
+		Creates an empty grid.
+		*/
+		TileGrid() : width(0), height(0), cols(0), rows(0), tileWidth(0), tileHeight(0), lastWidth(0), lastHeight(0) {};
+
+		bool operator==(const TileGrid &other) const {
+			return width == other.width && height == other.height && cols == other.cols && rows == other.rows;
+		}
+
+		/**
+		Gives the upper-left corner and the size of the tile in column fx and row fy.
+		*/
+		void tile(int fx, int fy, int &x, int &y, int &w, int &h) const {
+			x = fx * tileWidth;
+			y = fy * tileHeight;
+			w = fx == cols - 1 ? lastWidth : tileWidth;
+			h = fy == rows - 1 ? lastHeight : tileHeight;
+		}
+	};
+
+	/**
+	Gives the area [x0, x1) x [y0, y1) of the tile in column fx and row fy of grid in a width x height small frame of the full-size one. If extended, the area is widened to surely cover the pixels the sharpness check reads, otherwise the areas of the tiles do not overlap.
+	*/
+	void tileArea(const TileGrid &grid, int fx, int fy, int width, int height, bool extended, int &x0, int &y0, int &x1, int &y1);
+
+	/**
+	Builds the change map of the tiles of grid in dirty, marking the tiles having a pixel differing more than threshold in their extended area in the width x height small frames current and reference, and returns the number of changed tiles.
+	*/
+	int tileChanges(const unsigned char *current, const unsigned char *reference, int width, int height, const TileGrid &grid, int threshold, std::vector<unsigned char> &dirty);
+
+	/**
+	Adds to overLow the number of pixels among the len long a and b differing more than low, and to overHigh the number of those differing more than high, too, using SSE2 or NEON if enabled by USE_SIMD.
+	*/
+	void countDiffsOver(const unsigned char *a, const unsigned char *b, int len, int low, int high, int &overLow, int &overHigh);
+
+	/**
+	Counts the adjacent pixel differences of the sharpness check in the tiles of grid marked in dirty, streaming the Y plane of image row by row once. The distance of horizontally adjacent Y samples is step. Puts the number of vertical differences over low and over high, and the number of horizontal ones over low and over high for tile i to counts[4 * i] to counts[4 * i + 3], zero for tiles not dirty.
+	*/
+	void sharpTileCounts(const unsigned char *image, int step, const TileGrid &grid, int low, int high, const std::vector<unsigned char> &dirty, std::vector<int> &counts);
+
+	/**
+	Times each engine and decision on random moving and still frames of the still check size of 640x480 and 1280x720 camera frames downsampled by scale with the current options, and prints the results to std::cout.
+	*/
+	void benchmarkStillCheck(int scale);
+}
+
+#endif
@@ -14,15 +14,37 @@ namespace projector {
 	int Arguments::optShowOpts = 0;
 	int Arguments::optUseCurses = 0;
 	int Arguments::optShowWindow = 0;
+	int Arguments::optStillBenchmark = 0;
 	int Arguments::optVideoNum = VIDEO_NUM;
+	int Arguments::optOrientation = ORIENTATION;
+	int Arguments::optPlanarFrames = PLANAR_FRAMES;
+	const char *Arguments::optVideoList = NULL;
+	int Arguments::optReplayPaced = REPLAY_PACED;
+	const char *Arguments::optRecordFile = NULL;
+	int Arguments::optRecordCapacity = RECORD_CAPACITY;
+	int Arguments::optPrefetchWindow = PREFETCH_WINDOW;
+	const char *Arguments::optReplayFile = NULL;
+	int Arguments::optZeroCopy = ZERO_COPY;
+	int Arguments::optBufferCount = BUFFER_COUNT;
+	int Arguments::optDrainQueue = DRAIN_QUEUE;
+	int Arguments::optAsyncCapture = ASYNC_CAPTURE;
+	int Arguments::optRingSize = RING_SIZE;
+	int Arguments::optConvertThreads = CONVERT_THREADS;
+	int Arguments::optConvertMinPixels = CONVERT_MIN_PIXELS;
 	int Arguments::optGetchDelay = GETCH_DELAY;
 	int Arguments::optHandlerTimeout = HANDLER_TIMEOUT;
 	int Arguments::optForceHandlerExit = FORCE_HANDLER_EXIT;
 	int Arguments::optUseStaleFrame = USE_STALE_FRAME;
 	int Arguments::optStillDownsampleExponent = STILL_DOWNSAMPLE_EXPONENT;
+	int Arguments::optStillScale = STILL_SCALE;
 	int Arguments::optStillChangeTime = STILL_CHANGE_TIME;
 	int Arguments::optStillNoiseThreshold = STILL_NOISE_THRESHOLD;
 	int Arguments::optStillSamplingInc = STILL_SAMPLING_INC;
+	int Arguments::optStillEngine = STILL_ENGINE;
+	int Arguments::optStillDecision = STILL_DECISION;
+	int Arguments::optStillSprtAlpha = STILL_SPRT_ALPHA;
+	int Arguments::optStillSprtBeta = STILL_SPRT_BETA;
+	int Arguments::optStillSprtMargin = STILL_SPRT_MARGIN;
 	int Arguments::optStillSamplingPercent = STILL_SAMPLING_PERCENT;
 	int Arguments::optStillDeflectionPercent = STILL_DEFLECTION_PERCENT;
 	int Arguments::optSharpTilesPerSide = SHARP_TILES_PER_SIDE;
@@ -30,18 +52,40 @@ namespace projector {
 	int Arguments::optSharpDiffHigh = SHARP_DIFF_HIGH;
 	int Arguments::optSharpHighPercent = SHARP_HIGH_PERCENT;
 	int Arguments::optSharpTilesRequired = SHARP_TILES_REQUIRED;
+	int Arguments::optSharpTileCache = SHARP_TILE_CACHE;
 
 	const OptLimits Arguments::optLimits[] = {
             {OPT_NONE, 0, 0, NULL}, // getopt_long return value 0 means it has set the veriable
             {OPT_VIDEO_NUM, 0, 9, &optVideoNum},
+            {OPT_ORIENTATION, 0, 5, &optOrientation},
+            {OPT_PLANAR_FRAMES, 0, 1, &optPlanarFrames},
+            {OPT_VIDEO_LIST, 0, 0, NULL},  // text argument
+            {OPT_REPLAY_FILE, 0, 0, NULL},  // text argument
+            {OPT_REPLAY_PACED, 0, 1, &optReplayPaced},
+            {OPT_RECORD_FILE, 0, 0, NULL},  // text argument
+            {OPT_RECORD_CAPACITY, 1, 1500, &optRecordCapacity},
+            {OPT_PREFETCH_WINDOW, 0, 64, &optPrefetchWindow},
+            {OPT_ZERO_COPY, 0, 1, &optZeroCopy},
+            {OPT_BUFFER_COUNT, 1, 10, &optBufferCount},
+            {OPT_DRAIN_QUEUE, 0, 1, &optDrainQueue},
+            {OPT_ASYNC_CAPTURE, 0, 1, &optAsyncCapture},
+            {OPT_RING_SIZE, 2, 16, &optRingSize},
+            {OPT_CONVERT_THREADS, 1, 16, &optConvertThreads},
+            {OPT_CONVERT_MIN_PIXELS, 0, 100000000, &optConvertMinPixels},
             {OPT_GETCH_DELAY, 10, 5000, &optGetchDelay},
             {OPT_HANDLER_TIMEOUT, 0, 2000, &optHandlerTimeout},
             {OPT_FORCE_HANDLER_EXIT, 0, 1, &optForceHandlerExit},
             {OPT_USE_STALE_FRAME, 0, 1, &optUseStaleFrame},
             {OPT_STILL_DOWNSAMPLE_EXPONENT, 0, 3, &optStillDownsampleExponent},
+            {OPT_STILL_SCALE, 0, 16, &optStillScale},
             {OPT_STILL_CHANGE_TIME, 0, 10000, &optStillChangeTime},
             {OPT_STILL_NOISE_THRESHOLD, 1, 100, &optStillNoiseThreshold},
             {OPT_STILL_SAMPLING_INC, 2, 4441, &optStillSamplingInc},
+            {OPT_STILL_ENGINE, 0, 2, &optStillEngine},
+            {OPT_STILL_DECISION, 0, 2, &optStillDecision},
+            {OPT_STILL_SPRT_ALPHA, 1, 500, &optStillSprtAlpha},
+            {OPT_STILL_SPRT_BETA, 1, 500, &optStillSprtBeta},
+            {OPT_STILL_SPRT_MARGIN, 1, 90, &optStillSprtMargin},
             {OPT_STILL_SAMPLING_PERCENT, 0, 20, &optStillSamplingPercent},
             {OPT_STILL_DEFLECTION_PERCENT, 0, 20, &optStillDeflectionPercent},
             {OPT_SHARP_TILES_PER_SIDE, 1, 40, &optSharpTilesPerSide},
@@ -49,6 +93,7 @@ namespace projector {
             {OPT_SHARP_DIFF_HIGH, 2, 100, &optSharpDiffHigh},
             {OPT_SHARP_HIGH_PERCENT, 0, 100, &optSharpHighPercent},
             {OPT_SHARP_TILES_REQUIRED, 0, 100, &optSharpTilesRequired},
+            {OPT_SHARP_TILE_CACHE, 0, 1, &optSharpTileCache},
             {OPT_END, -1, -1, NULL}
     };
 
@@ -57,15 +102,37 @@ namespace projector {
             {"show-opts", no_argument, &optShowOpts, 1},
             {"use-curses", no_argument, &optUseCurses, 1},
             {"show-window", no_argument, &optShowWindow, 1},
+            {"still-benchmark", no_argument, &optStillBenchmark, 1},
             {"video-num", required_argument, NULL, OPT_VIDEO_NUM},
+            {"orientation", required_argument, NULL, OPT_ORIENTATION},
+            {"planar-frames", required_argument, NULL, OPT_PLANAR_FRAMES},
+            {"video-list", required_argument, NULL, OPT_VIDEO_LIST},
+            {"replay-file", required_argument, NULL, OPT_REPLAY_FILE},
+            {"replay-paced", required_argument, NULL, OPT_REPLAY_PACED},
+            {"record-file", required_argument, NULL, OPT_RECORD_FILE},
+            {"record-capacity", required_argument, NULL, OPT_RECORD_CAPACITY},
+            {"prefetch-window", required_argument, NULL, OPT_PREFETCH_WINDOW},
+            {"zero-copy", required_argument, NULL, OPT_ZERO_COPY},
+            {"buffer-count", required_argument, NULL, OPT_BUFFER_COUNT},
+            {"drain-queue", required_argument, NULL, OPT_DRAIN_QUEUE},
+            {"async-capture", required_argument, NULL, OPT_ASYNC_CAPTURE},
+            {"ring-size", required_argument, NULL, OPT_RING_SIZE},
+            {"convert-threads", required_argument, NULL, OPT_CONVERT_THREADS},
+            {"convert-min-pixels", required_argument, NULL, OPT_CONVERT_MIN_PIXELS},
             {"getch-delay", required_argument, NULL, OPT_GETCH_DELAY},
             {"handler-timeout", required_argument, NULL, OPT_HANDLER_TIMEOUT},
             {"force-handler-exit", required_argument, NULL, OPT_FORCE_HANDLER_EXIT},
             {"use-stale-frame", required_argument, NULL, OPT_USE_STALE_FRAME},
             {"still-downsample-exponent", required_argument, NULL, OPT_STILL_DOWNSAMPLE_EXPONENT},
+            {"still-scale", required_argument, NULL, OPT_STILL_SCALE},
             {"still-change-time", required_argument, NULL, OPT_STILL_CHANGE_TIME},
             {"still-noise-limit", required_argument, NULL, OPT_STILL_NOISE_THRESHOLD},
             {"still-sample-inc", required_argument, NULL, OPT_STILL_SAMPLING_INC},
+            {"still-engine", required_argument, NULL, OPT_STILL_ENGINE},
+            {"still-decision", required_argument, NULL, OPT_STILL_DECISION},
+            {"still-sprt-alpha", required_argument, NULL, OPT_STILL_SPRT_ALPHA},
+            {"still-sprt-beta", required_argument, NULL, OPT_STILL_SPRT_BETA},
+            {"still-sprt-margin", required_argument, NULL, OPT_STILL_SPRT_MARGIN},
             {"still-sample-percent", required_argument, NULL, OPT_STILL_SAMPLING_PERCENT},
             {"still-deflection-percent", required_argument, NULL, OPT_STILL_DEFLECTION_PERCENT},
             {"sharp-tiles-per-side", required_argument, NULL, OPT_SHARP_TILES_PER_SIDE},
@@ -73,6 +140,7 @@ namespace projector {
             {"sharp-diff-high", required_argument, NULL, OPT_SHARP_DIFF_HIGH},
             {"sharp-high-percent", required_argument, NULL, OPT_SHARP_HIGH_PERCENT},
             {"sharp-tiles-req", required_argument, NULL, OPT_SHARP_TILES_REQUIRED},
+            {"sharp-tile-cache", required_argument, NULL, OPT_SHARP_TILE_CACHE},
             {0, 0, 0, 0}
     };
 
@@ -100,6 +168,17 @@ namespace projector {
 	        }
 		    else {
             // here comes a switch for string arguments
+				switch(opt) {
+				case OPT_VIDEO_LIST:
+					optVideoList = optarg;
+					break;
+				case OPT_REPLAY_FILE:
+					optReplayFile = optarg;
+					break;
+				case OPT_RECORD_FILE:
+					optRecordFile = optarg;
+					break;
+				}
 			}
 	    }
 	}
@@ -107,21 +186,44 @@ namespace projector {
 	void Arguments::showOpts() {
 		std::cout << "-use-curses: " << optUseCurses << '\n';
 		std::cout << "-show-window: " << optShowWindow << '\n';
+		std::cout << "-still-benchmark: " << optStillBenchmark << '\n';
 		std::cout << "-video-num: " << optVideoNum << '\n';
+		std::cout << "-orientation: " << optOrientation << '\n';
+		std::cout << "-planar-frames: " << optPlanarFrames << '\n';
+		std::cout << "-video-list: " << (optVideoList == NULL ? "-" : optVideoList) << '\n';
+		std::cout << "-replay-file: " << (optReplayFile == NULL ? "-" : optReplayFile) << '\n';
+		std::cout << "-replay-paced: " << optReplayPaced << '\n';
+		std::cout << "-record-file: " << (optRecordFile == NULL ? "-" : optRecordFile) << '\n';
+		std::cout << "-record-capacity: " << optRecordCapacity << '\n';
+		std::cout << "-prefetch-window: " << optPrefetchWindow << '\n';
+		std::cout << "-zero-copy: " << optZeroCopy << '\n';
+		std::cout << "-buffer-count: " << optBufferCount << '\n';
+		std::cout << "-drain-queue: " << optDrainQueue << '\n';
+		std::cout << "-async-capture: " << optAsyncCapture << '\n';
+		std::cout << "-ring-size: " << optRingSize << '\n';
+		std::cout << "-convert-threads: " << optConvertThreads << '\n';
+		std::cout << "-convert-min-pixels: " << optConvertMinPixels << '\n';
 		std::cout << "-getch-delay: " << optGetchDelay << '\n';
 		std::cout << "-handler-timeout: " << optHandlerTimeout << '\n';
 		std::cout << "-force-handler-exit: " << optForceHandlerExit << '\n';
 		std::cout << "-use-stale-frame: " << optUseStaleFrame << '\n';
 		std::cout << "-still-downsample-exponent: " << optStillDownsampleExponent << '\n';
+		std::cout << "-still-scale: " << optStillScale << '\n';
 		std::cout << "-still-noise-limit: " << optStillNoiseThreshold << '\n';
 		std::cout << "-still-change-time: " << optStillChangeTime << '\n';
 		std::cout << "-still-sample-inc: " << optStillSamplingInc << '\n';
+		std::cout << "-still-engine: " << optStillEngine << '\n';
+		std::cout << "-still-decision: " << optStillDecision << '\n';
+		std::cout << "-still-sprt-alpha: " << optStillSprtAlpha << '\n';
+		std::cout << "-still-sprt-beta: " << optStillSprtBeta << '\n';
+		std::cout << "-still-sprt-margin: " << optStillSprtMargin << '\n';
 		std::cout << "-still-sample-percent: " << optStillSamplingPercent << '\n';
 		std::cout << "-still-deflection-percent: " << optStillDeflectionPercent << '\n';
 		std::cout << "-sharp-tiles-per-side: " << optSharpTilesPerSide << '\n';
 		std::cout << "-sharp-diff-low: " << optSharpDiffLow << '\n';
 		std::cout << "-sharp-diff-high: " << optSharpDiffHigh << '\n';
 		std::cout << "-sharp-high-percent: " << optSharpHighPercent << '\n';
-		std::cout << "-sharp-tiles-req: " << optSharpTilesRequired << std::endl;
+		std::cout << "-sharp-tiles-req: " << optSharpTilesRequired << '\n';
+		std::cout << "-sharp-tile-cache: " << optSharpTileCache << std::endl;
 	}
 }
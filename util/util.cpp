@@ -240,6 +240,14 @@ void StartStop::start() {
     sch.sched_priority = priority == -1 ? sched_get_priority_max(SCHED_FIFO) : priority;
     if(pthread_setschedparam(nativeHandle, SCHED_FIFO, &sch)) {
         std::cerr << "Cannot set filter thread priority." << std::endl;
+    }
+    if(cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if(pthread_setaffinity_np(nativeHandle, sizeof(cpus), &cpus)) {
+            std::cerr << "Cannot pin thread to core " << cpu << '.' << std::endl;
+        }
     }
 	DEB1("started.");
 }
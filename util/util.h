@@ -463,6 +463,11 @@ Show the OpenCV Mat img using OpenCV imshow function if windowing is enabled and
 		Priority of theThread if allowed to be set.
 		*/
         int priority = -1;
+
+		/**
+		Processor core theThread is pinned to, -1 if it may run on any.
+		*/
+        int cpu = -1;
 	
 		/**
 		The thread performing the tasks defined in subclasses.
@@ -484,6 +489,11 @@ Show the OpenCV Mat img using OpenCV imshow function if windowing is enabled and
 		Does nothing.
 		*/
         StartStop() {};
+
+		/**
+		Pins the thread started by subsequent start() calls to processor core core, -1 to let it run on any.
+		*/
+        void setAffinity(int core) { cpu = core; }
         
 		/**
 		Calls stop().